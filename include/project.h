@@ -27,5 +27,17 @@ __asm__(".pushsection _data_projectptrs, \"aw\", @progbits\n" \
 _Bool run_helper(const char *helper_filename, const char *helper_argv1,
 	DIR *dir, FILE *auditf, FILE *outf, int tarfd);
 
+/* A ready-made check_sanity. Use it with a struct sanity_policy as the
+ * check_sanity_arg, or call it from your own check_sanity. It rejects tar
+ * submissions that break the policy; other formats are let through. */
+struct sanity_policy
+{
+	const char **required_paths;       /* NULL-terminated; may be NULL */
+	const char **forbidden_extensions; /* e.g. ".o"; NULL-terminated; may be NULL */
+	size_t max_file_size;              /* per file, in bytes; 0 means no limit */
+	_Bool reject_binary;               /* reject files containing NUL bytes */
+};
+_Bool check_sanity_policy(DIR *dir, FILE *auditf, FILE *outf, int tarfd, void *arg);
+
 
 #endif
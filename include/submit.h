@@ -0,0 +1,95 @@
+#ifndef AUTOFEEDBACK_SUBMIT_H_
+#define AUTOFEEDBACK_SUBMIT_H_
+
+/* Declarations shared between submit.c and the other pieces that get
+ * linked into the submit/feedback binary. Module libraries should only
+ * need project.h. */
+
+#include <sys/types.h>
+#include <stdint.h>
+
+extern const char submissions_path_prefix[];
+extern const char submission_format_ext[];
+extern char *submitting_user;
+extern uid_t ruid;
+extern gid_t rgid;
+extern _Bool audit_success;
+struct project;
+extern struct project **projects; /* indexed by project number */
+
+/* The request board: a lecturer-owned shared-memory table with one slot
+ * per in-flight request, updated lock-free, so that 'afb-top' can show
+ * what is going on (e.g. during a deadline). It is strictly best-effort:
+ * if we can't get at it, requests proceed unrecorded. */
+enum board_phase
+{
+	PHASE_FREE = 0,
+	PHASE_STARTING,
+	PHASE_LOCKING,    /* waiting on, or holding, the audit log lock */
+	PHASE_ARCHIVING,  /* copying the student's directory into the submission file */
+	PHASE_SANITY,
+	PHASE_FINALISING,
+	PHASE_FEEDBACK,   /* running the write-feedback helper */
+	PHASE_MAX
+};
+void board_enter(const char *user, unsigned project, const char *mode);
+void board_phase(enum board_phase phase);
+void board_audit_lock(_Bool held);
+void board_bytes(unsigned long bytes);
+void board_leave(void);
+int board_top(int argc, char **argv);
+
+/* SHA-256, used to give canonical archives a stable identifier. */
+#define SHA256_HEX_LEN 64
+struct sha256_ctx
+{
+	uint32_t h[8];
+	uint64_t len;
+	unsigned char buf[64];
+	size_t buflen;
+};
+void sha256_init(struct sha256_ctx *ctx);
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len);
+void sha256_final_hex(struct sha256_ctx *ctx, char hex[SHA256_HEX_LEN + 1]);
+int sha256_fd_hex(int fd, char hex[SHA256_HEX_LEN + 1]);
+
+/* Lecturer-only tools. */
+_Bool parse_submission_name(const char *name, unsigned num,
+	const char **user_out, size_t *userlen_out);
+_Bool parse_deadline_name(const char *name, unsigned num,
+	const char **user_out, size_t *userlen_out);
+int lock_audit_log(int subsfd); /* blocking; close the fd to unlock */
+int collect_main(unsigned num, int argc, char **argv);
+int replay_main(unsigned num, int argc, char **argv);
+int pack_main(unsigned num, int argc, char **argv);
+int audit_main(int argc, char **argv);
+
+/* Per-project pack files of closed projects' submissions (see pack.c). */
+#define PACK_NAME_MAX 160
+struct pack_entry
+{
+	char name[PACK_NAME_MAX]; /* the original file name, i.e. identifier */
+	uint64_t offset;
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t mode;
+	uint32_t reserved;
+};
+struct pack
+{
+	int fd;
+	size_t nentries;
+	struct pack_entry *entries; /* sorted by name */
+};
+struct pack *pack_open(unsigned num); /* NULL if there is no pack */
+void pack_close(struct pack *p);
+const struct pack_entry *pack_lookup(const struct pack *p, const char *name);
+int pack_extract(const struct pack *p, const struct pack_entry *e, int outfd);
+int open_submission(int subsfd, const struct pack *p, const char *name);
+_Bool pack_entry_is_callers(const struct pack_entry *e, unsigned num);
+int catsub_main(unsigned num, int argc, char **argv);
+
+#endif
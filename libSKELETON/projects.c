@@ -15,15 +15,24 @@
 #error "MODULE must be defined"
 #endif
 
+/* Edit this to suit the project. */
+static const char *forbidden_extensions_test[] = { ".o", ".so", ".class", ".exe", NULL };
+static struct sanity_policy sanity_policy_test = {
+	.required_paths = NULL,
+	.forbidden_extensions = forbidden_extensions_test,
+	.max_file_size = 1024000, /* 1000 kB */
+	.reject_binary = 1
+};
+
 static _Bool check_sanity_test(DIR *dir, FILE *auditf, FILE *outf, int tarfd, void *arg)
 {
 	/* We are run with the invoking user's privileges, not the lecturer's.
 	 * We simply sanity-check the submission, i.e. whether our feedback
-	 * etc could possibly work. It's allowed to do nothing. Unlike the
-	 * others, it runs before a tar file has been created, so it can
-	 * do something like check whether the tar file would be too big. */
-
-	return 1;
+	 * etc could possibly work. It's allowed to do nothing. It runs on the
+	 * finished submission file, but before any feedback helper is run.
+	 * By default we apply a declarative policy; note that our arg is
+	 * taken by the commit string (for git-format submissions). */
+	return check_sanity_policy(dir, auditf, outf, tarfd, &sanity_policy_test);
 }
 static _Bool write_feedback_test(DIR *dir, FILE *auditf, FILE *outf, int tarfd, void *arg)
 {
@@ -38,3 +38,23 @@ audit_log_message () {
     # the file, whose line number it is, should be on stdin
     (audit_log_date_prefix; echo "$msg" ) >&8
 }
+
+# For SUBMISSION_FORMAT_GIT_BUNDLE: the submission on stdin is a bundle of
+# the student's commits since the project's base commit, so it lacks the
+# base's objects. Check it out into a fresh repo at "$1", borrowing those
+# objects from the lecturer's repository "$2" (which must contain the base
+# commit) via an alternate, rather than copying them.
+checkout_bundle_submission () {
+    local dest="$1"
+    local base_objects
+    base_objects="$( cd "$2" && readlink -f "$( git rev-parse --git-path objects )" )" || return 1
+    git init -q "$dest" || return 1
+    echo "$base_objects" > "$dest"/.git/objects/info/alternates
+    cat > "$dest"/.git/submission.bundle
+    if ! git -C "$dest" bundle verify .git/submission.bundle >/dev/null 2>&1; then
+        echo "Submission bundle does not verify against the base in $2" 1>&2
+        return 1
+    fi
+    git -C "$dest" fetch -q .git/submission.bundle HEAD &&
+    git -C "$dest" checkout -q --detach FETCH_HEAD
+}
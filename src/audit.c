@@ -0,0 +1,701 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "submit.h"
+
+/* 'afb-audit [options] [summary|rate|users|projects]': questions about
+ * audit.log (and its rotated segments audit.log.1, audit.log.2, ...)
+ * without grepping the whole lot each time. We keep a compact columnar
+ * summary, audit.summary, next to the log: one row per request-related
+ * line (initiations and outcomes), with its time, kind, user and project.
+ * Each run parses only what has been appended since the last, splitting
+ * the new bytes of each segment into line-aligned chunks that are parsed
+ * in parallel from an mmap(). Rows outlive the segments they came from,
+ * so history survives the rotated logs being deleted.
+ *
+ * Which request an outcome line ("Request succeeded" etc.) belongs to is
+ * not written on the line, but since requests hold the audit lock from
+ * their initiation line until their outcome, it is the nearest preceding
+ * initiation. We work that out at query time with one sequential pass.
+ * Feedback requests are the exception: once sane, they log "Delegating to
+ * write-feedback handling", release the lock and log nothing more, so
+ * their real outcome is unknown. We count those (and requests with no
+ * outcome line at all) separately, and leave them out of failure rates. */
+
+#ifndef AUDIT_MAX_THREADS
+#define AUDIT_MAX_THREADS 16
+#endif
+#define AUDIT_MAX_SEGMENTS 64
+/* Below this, threads cost more than they save. */
+#define AUDIT_MIN_CHUNK (1ul << 20)
+
+enum audit_kind
+{
+	KIND_SUBMIT = 1,
+	KIND_FEEDBACK,
+	KIND_SUCCEEDED,
+	KIND_FAILED,
+	KIND_INSANE,
+	KIND_DELEGATED
+};
+
+#define NO_USER UINT32_MAX
+
+/* The summary file. */
+static const char summary_magic[8] = "AFBAUDS1";
+struct summary_header
+{
+	char magic[8];
+	uint32_t nsegments;
+	uint32_t nusers;
+	uint64_t nrows;
+	uint64_t users_bytes;
+};
+struct summary_segment
+{
+	uint64_t dev;
+	uint64_t ino;
+	/* Rotation can recycle inode numbers, so we also recognise a segment
+	 * by its first line, which never changes once written. */
+	uint64_t first_line_hash;
+	uint64_t parsed; /* bytes of complete lines already summarised */
+};
+
+/* In memory, the columns are growable arrays. */
+struct summary
+{
+	struct summary_segment segments[AUDIT_MAX_SEGMENTS];
+	uint32_t nsegments;
+	int64_t *time;
+	uint32_t *user;
+	uint8_t *project;
+	uint8_t *kind;
+	uint64_t nrows;
+	uint64_t rows_cap;
+	char **users;
+	uint32_t nusers;
+	uint32_t users_cap;
+	/* open-addressed hash of users, for interning */
+	uint32_t *user_hash;
+	uint32_t user_hash_cap;
+};
+
+static void *xrealloc(void *p, size_t sz)
+{
+	p = realloc(p, sz ? sz : 1);
+	if (!p) err(EXIT_FAILURE, "allocating audit summary");
+	return p;
+}
+
+static void summary_reserve(struct summary *s, uint64_t nrows)
+{
+	if (nrows <= s->rows_cap) return;
+	uint64_t cap = s->rows_cap ? s->rows_cap : 4096;
+	while (cap < nrows) cap *= 2;
+	s->time = xrealloc(s->time, cap * sizeof *s->time);
+	s->user = xrealloc(s->user, cap * sizeof *s->user);
+	s->project = xrealloc(s->project, cap * sizeof *s->project);
+	s->kind = xrealloc(s->kind, cap * sizeof *s->kind);
+	s->rows_cap = cap;
+}
+
+static uint32_t hash_str(const char *str, size_t len)
+{
+	uint32_t h = 2166136261u; // FNV-1a
+	for (size_t i = 0; i < len; ++i) h = (h ^ (unsigned char) str[i]) * 16777619u;
+	return h;
+}
+
+/* 0 if there is no complete first line yet (so nothing parsed either).
+ * Lines can be long (initiations quote the student's directory twice),
+ * so we hash however much it takes to reach the newline. */
+static uint64_t first_line_hash(int fd)
+{
+	uint64_t h = 14695981039346656037ull; // FNV-1a again, 64-bit this time
+	char buf[4096];
+	off_t off = 0;
+	ssize_t n;
+	while (0 < (n = pread(fd, buf, sizeof buf, off)))
+	{
+		const char *nl = memchr(buf, '\n', n);
+		const char *end = nl ? nl : buf + n;
+		for (const char *p = buf; p < end; ++p) h = (h ^ (unsigned char) *p) * 1099511628211ull;
+		if (nl) return h ? h : 1;
+		off += n;
+	}
+	return 0;
+}
+
+static void rehash_users(struct summary *s)
+{
+	s->user_hash_cap = s->user_hash_cap ? 2 * s->user_hash_cap : 1024;
+	free(s->user_hash);
+	s->user_hash = xrealloc(NULL, s->user_hash_cap * sizeof *s->user_hash);
+	memset(s->user_hash, 0xff, s->user_hash_cap * sizeof *s->user_hash);
+	for (uint32_t i = 0; i < s->nusers; ++i)
+	{
+		uint32_t h = hash_str(s->users[i], strlen(s->users[i])) & (s->user_hash_cap - 1);
+		while (s->user_hash[h] != NO_USER) h = (h + 1) & (s->user_hash_cap - 1);
+		s->user_hash[h] = i;
+	}
+}
+
+static uint32_t intern_user(struct summary *s, const char *str, size_t len)
+{
+	if (2 * (s->nusers + 1) > s->user_hash_cap) rehash_users(s);
+	uint32_t h = hash_str(str, len) & (s->user_hash_cap - 1);
+	for (; s->user_hash[h] != NO_USER; h = (h + 1) & (s->user_hash_cap - 1))
+	{
+		const char *u = s->users[s->user_hash[h]];
+		if (0 == strncmp(u, str, len) && u[len] == '\0') return s->user_hash[h];
+	}
+	if (s->nusers == s->users_cap)
+	{
+		s->users_cap = s->users_cap ? 2 * s->users_cap : 256;
+		s->users = xrealloc(s->users, s->users_cap * sizeof *s->users);
+	}
+	s->users[s->nusers] = strndup(str, len);
+	if (!s->users[s->nusers]) err(EXIT_FAILURE, "strndup");
+	s->user_hash[h] = s->nusers;
+	return s->nusers++;
+}
+
+static char *summary_path(void)
+{
+	char *path;
+	if (asprintf(&path, "%s/audit.summary", submissions_path_prefix) < 0)
+		errx(EXIT_FAILURE, "printing summary path");
+	return path;
+}
+
+static _Bool read_exactly(FILE *f, void *buf, size_t len)
+{
+	return fread(buf, 1, len, f) == len;
+}
+
+/* Load the cached summary, if there is a usable one. */
+static void summary_load(struct summary *s)
+{
+	char *path = summary_path();
+	FILE *f = fopen(path, "r");
+	free(path);
+	if (!f) return;
+	struct summary_header h;
+	if (!read_exactly(f, &h, sizeof h) || 0 != memcmp(h.magic, summary_magic, sizeof h.magic)
+			|| h.nsegments > AUDIT_MAX_SEGMENTS)
+	{
+		warnx("ignoring unreadable audit summary; rebuilding it");
+		fclose(f);
+		return;
+	}
+	char *users_buf = xrealloc(NULL, h.users_bytes);
+	summary_reserve(s, h.nrows);
+	if (!read_exactly(f, s->segments, h.nsegments * sizeof *s->segments)
+			|| !read_exactly(f, users_buf, h.users_bytes)
+			|| !read_exactly(f, s->time, h.nrows * sizeof *s->time)
+			|| !read_exactly(f, s->user, h.nrows * sizeof *s->user)
+			|| !read_exactly(f, s->project, h.nrows * sizeof *s->project)
+			|| !read_exactly(f, s->kind, h.nrows * sizeof *s->kind))
+	{
+		warnx("ignoring truncated audit summary; rebuilding it");
+		free(users_buf);
+		fclose(f);
+		return;
+	}
+	s->nsegments = h.nsegments;
+	s->nrows = h.nrows;
+	for (const char *u = users_buf; u < users_buf + h.users_bytes; u += strlen(u) + 1)
+	{
+		intern_user(s, u, strlen(u));
+	}
+	free(users_buf);
+	fclose(f);
+}
+
+static void summary_save(const struct summary *s)
+{
+	char *path = summary_path();
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) errx(EXIT_FAILURE, "printing summary path");
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) err(EXIT_FAILURE, "creating %s", tmp_path);
+	FILE *f = fdopen(fd, "w");
+	if (!f) err(EXIT_FAILURE, "fdopen");
+	struct summary_header h = { .nsegments = s->nsegments, .nusers = s->nusers, .nrows = s->nrows };
+	memcpy(h.magic, summary_magic, sizeof h.magic);
+	for (uint32_t i = 0; i < s->nusers; ++i) h.users_bytes += strlen(s->users[i]) + 1;
+	fwrite(&h, sizeof h, 1, f);
+	fwrite(s->segments, sizeof *s->segments, s->nsegments, f);
+	for (uint32_t i = 0; i < s->nusers; ++i) fwrite(s->users[i], 1, strlen(s->users[i]) + 1, f);
+	fwrite(s->time, sizeof *s->time, s->nrows, f);
+	fwrite(s->user, sizeof *s->user, s->nrows, f);
+	fwrite(s->project, sizeof *s->project, s->nrows, f);
+	fwrite(s->kind, sizeof *s->kind, s->nrows, f);
+	if (0 != fclose(f)) err(EXIT_FAILURE, "writing %s", tmp_path);
+	if (0 != rename(tmp_path, path)) err(EXIT_FAILURE, "renaming %s to %s", tmp_path, path);
+	free(tmp_path);
+	free(path);
+}
+
+/* Parsing. Each worker fills its own vector of raw rows, whose users are
+ * still just ranges of the mapping; interning happens afterwards. */
+struct raw_row
+{
+	int64_t time;
+	uint64_t user_off;
+	uint32_t user_len;
+	uint8_t project;
+	uint8_t kind;
+};
+
+struct parse_job
+{
+	const char *base;
+	size_t start;
+	size_t end;
+	struct raw_row *rows;
+	size_t nrows;
+	size_t cap;
+};
+
+static int64_t days_from_civil(int64_t y, unsigned m, unsigned d)
+{
+	y -= m <= 2;
+	int64_t era = (y >= 0 ? y : y - 399) / 400;
+	unsigned yoe = (unsigned) (y - era * 400);
+	unsigned doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+	unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + (int64_t) doe - 719468;
+}
+
+static _Bool digits(const char *p, unsigned n, unsigned *out)
+{
+	unsigned v = 0;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		if (p[i] < '0' || p[i] > '9') return 0;
+		v = v * 10 + (p[i] - '0');
+	}
+	*out = v;
+	return 1;
+}
+
+/* Parse "%F %T" (UTC, as audit_println_helper writes it). */
+static _Bool parse_timestamp(const char *p, size_t len, int64_t *out)
+{
+	unsigned y, mo, d, h, mi, s;
+	if (len < 19 || p[4] != '-' || p[7] != '-' || p[10] != ' ' || p[13] != ':' || p[16] != ':'
+			|| !digits(p, 4, &y) || !digits(p + 5, 2, &mo) || !digits(p + 8, 2, &d)
+			|| !digits(p + 11, 2, &h) || !digits(p + 14, 2, &mi) || !digits(p + 17, 2, &s)
+			|| mo < 1 || mo > 12 || d < 1 || d > 31)
+	{
+		return 0;
+	}
+	*out = days_from_civil(y, mo, d) * 86400 + h * 3600 + mi * 60 + s;
+	return 1;
+}
+
+#define starts_with(p, len, lit) ((len) >= sizeof lit - 1 && 0 == memcmp((p), lit, sizeof lit - 1))
+
+static void parse_line(struct parse_job *job, const char *line, size_t len)
+{
+	struct raw_row row = { .user_len = 0, .project = 0 };
+	if (!parse_timestamp(line, len, &row.time) || len < 20) return;
+	const char *p = line + 20;
+	size_t rest = len - 20;
+	if (starts_with(p, rest, "User "))
+	{
+		/* User %s initiated %s request on project %s, dir ... */
+		const char *user = p + sizeof "User " - 1;
+		const char *end = line + len;
+		const char *initiated = memmem(user, end - user, " initiated ", sizeof " initiated " - 1);
+		if (!initiated) return;
+		const char *what = initiated + sizeof " initiated " - 1;
+		size_t what_len = end - what;
+		if (starts_with(what, what_len, "submission ")) row.kind = KIND_SUBMIT;
+		else if (starts_with(what, what_len, "feedback ")) row.kind = KIND_FEEDBACK;
+		else return;
+		const char *proj = memmem(what, what_len, " on project ", sizeof " on project " - 1);
+		if (proj)
+		{
+			unsigned n = 0;
+			for (proj += sizeof " on project " - 1; proj < end && *proj >= '0' && *proj <= '9'; ++proj)
+				n = n * 10 + (*proj - '0');
+			row.project = (n < 256) ? n : 0;
+		}
+		row.user_off = user - job->base;
+		row.user_len = initiated - user;
+	}
+	else if (starts_with(p, rest, "Request succeeded")) row.kind = KIND_SUCCEEDED;
+	else if (starts_with(p, rest, "Request failed for insanity")) row.kind = KIND_INSANE;
+	else if (starts_with(p, rest, "Request failed")) row.kind = KIND_FAILED;
+	else if (starts_with(p, rest, "Delegating to write-feedback handling")) row.kind = KIND_DELEGATED;
+	else return;
+	if (job->nrows == job->cap)
+	{
+		job->cap = job->cap ? 2 * job->cap : 4096;
+		job->rows = xrealloc(job->rows, job->cap * sizeof *job->rows);
+	}
+	job->rows[job->nrows++] = row;
+}
+
+static void *parse_worker(void *arg)
+{
+	struct parse_job *job = arg;
+	const char *p = job->base + job->start;
+	const char *end = job->base + job->end;
+	while (p < end)
+	{
+		const char *nl = memchr(p, '\n', end - p);
+		if (!nl) nl = end;
+		parse_line(job, p, nl - p);
+		p = nl + 1;
+	}
+	return NULL;
+}
+
+/* Summarise bytes [from, size) of one segment, up to its last newline.
+ * Returns how far we got. */
+static uint64_t parse_segment(struct summary *s, int fd, uint64_t from, uint64_t size)
+{
+	if (from >= size) return from;
+	const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) err(EXIT_FAILURE, "mapping audit log");
+	madvise((void *) (base + (from & ~(uint64_t) 4095)), size - (from & ~(uint64_t) 4095),
+		MADV_WILLNEED);
+	const char *last_nl = memrchr(base + from, '\n', size - from);
+	if (!last_nl) { munmap((void *) base, size); return from; }
+	uint64_t end = last_nl - base + 1;
+
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned nthreads = (end - from) / AUDIT_MIN_CHUNK + 1;
+	if (nthreads > ncpus && ncpus > 0) nthreads = ncpus;
+	if (nthreads > AUDIT_MAX_THREADS) nthreads = AUDIT_MAX_THREADS;
+	struct parse_job jobs[AUDIT_MAX_THREADS];
+	pthread_t threads[AUDIT_MAX_THREADS];
+	uint64_t chunk_start = from;
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		/* Split at the first line boundary at or after the even share. */
+		uint64_t chunk_end = (i == nthreads - 1) ? end : from + (end - from) * (i + 1) / nthreads;
+		if (chunk_end < chunk_start) chunk_end = chunk_start;
+		if (chunk_end < end)
+		{
+			const char *nl = memchr(base + chunk_end, '\n', end - chunk_end);
+			chunk_end = nl ? (uint64_t) (nl - base + 1) : end;
+		}
+		jobs[i] = (struct parse_job) { base, chunk_start, chunk_end, NULL, 0, 0 };
+		int ret = pthread_create(&threads[i], NULL, parse_worker, &jobs[i]);
+		if (ret != 0) { errno = ret; err(EXIT_FAILURE, "creating parser thread"); }
+		chunk_start = chunk_end;
+	}
+	/* Append in chunk order, so rows stay in log order. */
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		pthread_join(threads[i], NULL);
+		summary_reserve(s, s->nrows + jobs[i].nrows);
+		for (size_t j = 0; j < jobs[i].nrows; ++j)
+		{
+			const struct raw_row *r = &jobs[i].rows[j];
+			uint64_t k = s->nrows++;
+			s->time[k] = r->time;
+			s->kind[k] = r->kind;
+			s->project[k] = r->project;
+			s->user[k] = r->user_len ? intern_user(s, base + r->user_off, r->user_len) : NO_USER;
+		}
+		free(jobs[i].rows);
+	}
+	munmap((void *) base, size);
+	return end;
+}
+
+/* Bring the summary up to date with the log segments on disk, oldest
+ * (highest-numbered) first. */
+static void summary_update(struct summary *s)
+{
+	char *paths[AUDIT_MAX_SEGMENTS];
+	unsigned npaths = 0;
+	for (unsigned i = AUDIT_MAX_SEGMENTS - 1; i > 0; --i)
+	{
+		char *path;
+		if (asprintf(&path, "%s/audit.log.%u", submissions_path_prefix, i) < 0)
+			errx(EXIT_FAILURE, "printing audit log path");
+		if (0 == access(path, R_OK)) paths[npaths++] = path; else free(path);
+	}
+	if (asprintf(&paths[npaths++], "%s/audit.log", submissions_path_prefix) < 0)
+		errx(EXIT_FAILURE, "printing audit log path");
+
+	struct summary_segment segments[AUDIT_MAX_SEGMENTS];
+	unsigned nsegments = 0;
+	for (unsigned i = 0; i < npaths; ++i)
+	{
+		int fd = open(paths[i], O_RDONLY);
+		if (fd == -1) { warn("opening %s", paths[i]); free(paths[i]); continue; }
+		struct stat st;
+		if (0 != fstat(fd, &st)) err(EXIT_FAILURE, "stat'ing %s", paths[i]);
+		uint64_t hash = first_line_hash(fd);
+		uint64_t parsed = 0;
+		for (unsigned j = 0; j < s->nsegments; ++j)
+		{
+			if (s->segments[j].dev == st.st_dev && s->segments[j].ino == st.st_ino
+				&& s->segments[j].first_line_hash == hash)
+			{
+				parsed = s->segments[j].parsed;
+			}
+		}
+		if (parsed > (uint64_t) st.st_size)
+		{
+			warnx("%s has shrunk; summarising it afresh", paths[i]);
+			parsed = 0;
+		}
+		parsed = parse_segment(s, fd, parsed, st.st_size);
+		/* Re-read, in case the first line was completed while we parsed. */
+		hash = first_line_hash(fd);
+		segments[nsegments++] = (struct summary_segment) { st.st_dev, st.st_ino, hash, parsed };
+		close(fd);
+		free(paths[i]);
+	}
+	memcpy(s->segments, segments, nsegments * sizeof *segments);
+	s->nsegments = nsegments;
+}
+
+/* Queries. */
+struct audit_query
+{
+	int64_t since;
+	int64_t until;
+	unsigned project; /* 0 for all */
+	int64_t bucket;
+};
+
+/* Attribute each outcome to its request. For each initiation row we
+ * return the kind of its first outcome row (or 0). */
+#define OUTCOME_FAILED(o) ((o) == KIND_FAILED || (o) == KIND_INSANE)
+#define OUTCOME_UNKNOWN(o) ((o) == 0 || (o) == KIND_DELEGATED)
+static uint8_t *attribute_outcomes(const struct summary *s)
+{
+	uint8_t *outcome = calloc(s->nrows ? s->nrows : 1, 1);
+	if (!outcome) err(EXIT_FAILURE, "allocating outcomes");
+	uint64_t current = UINT64_MAX;
+	for (uint64_t i = 0; i < s->nrows; ++i)
+	{
+		if (s->kind[i] == KIND_SUBMIT || s->kind[i] == KIND_FEEDBACK) current = i;
+		else if (current != UINT64_MAX && !outcome[current]) outcome[current] = s->kind[i];
+	}
+	return outcome;
+}
+
+static _Bool selected(const struct summary *s, const struct audit_query *q, uint64_t i)
+{
+	return (s->kind[i] == KIND_SUBMIT || s->kind[i] == KIND_FEEDBACK)
+		&& s->time[i] >= q->since && s->time[i] < q->until
+		&& (!q->project || s->project[i] == q->project);
+}
+
+static void print_utc(int64_t t)
+{
+	time_t tt = t;
+	struct tm tm;
+	char buf[64];
+	strftime(buf, sizeof buf, "%F %T", gmtime_r(&tt, &tm));
+	fputs(buf, stdout);
+}
+
+static void query_summary(const struct summary *s, const struct audit_query *q)
+{
+	uint8_t *outcome = attribute_outcomes(s);
+	uint64_t n[KIND_DELEGATED + 1] = { 0 }, nfailed = 0, ninsane = 0, nunknown = 0;
+	int64_t first = INT64_MAX, last = INT64_MIN;
+	for (uint64_t i = 0; i < s->nrows; ++i)
+	{
+		if (!selected(s, q, i)) continue;
+		++n[s->kind[i]];
+		if (outcome[i] == KIND_FAILED) ++nfailed;
+		if (outcome[i] == KIND_INSANE) ++ninsane;
+		if (OUTCOME_UNKNOWN(outcome[i])) ++nunknown;
+		if (s->time[i] < first) first = s->time[i];
+		if (s->time[i] > last) last = s->time[i];
+	}
+	printf("%llu submission and %llu feedback request(s)",
+		(unsigned long long) n[KIND_SUBMIT], (unsigned long long) n[KIND_FEEDBACK]);
+	if (first <= last)
+	{
+		printf(" from ");
+		print_utc(first);
+		printf(" to ");
+		print_utc(last);
+		printf(" UTC");
+	}
+	printf("\n%llu failed, of which %llu for insanity; %llu with outcome unknown"
+		" (delegated to write-feedback, or unfinished); %u distinct user(s) in the log\n",
+		(unsigned long long) (nfailed + ninsane), (unsigned long long) ninsane,
+		(unsigned long long) nunknown, s->nusers);
+	free(outcome);
+}
+
+static int compar_u64(const void *p1, const void *p2)
+{
+	uint64_t a = *(const uint64_t *) p1, b = *(const uint64_t *) p2;
+	return (a > b) - (a < b);
+}
+
+static void query_rate(const struct summary *s, const struct audit_query *q)
+{
+	int64_t first = INT64_MAX, last = INT64_MIN;
+	for (uint64_t i = 0; i < s->nrows; ++i)
+	{
+		if (!selected(s, q, i)) continue;
+		if (s->time[i] < first) first = s->time[i];
+		if (s->time[i] > last) last = s->time[i];
+	}
+	if (first > last) { printf("no requests\n"); return; }
+	first -= first % q->bucket;
+	uint64_t nbuckets = (last - first) / q->bucket + 1;
+	if (nbuckets > 10000000) errx(EXIT_FAILURE, "too many buckets; use a bigger bucket or a narrower range");
+	uint64_t *counts = calloc(nbuckets, sizeof *counts);
+	if (!counts) err(EXIT_FAILURE, "allocating buckets");
+	for (uint64_t i = 0; i < s->nrows; ++i)
+	{
+		if (selected(s, q, i)) ++counts[(s->time[i] - first) / q->bucket];
+	}
+	for (uint64_t b = 0; b < nbuckets; ++b)
+	{
+		if (!counts[b]) continue;
+		print_utc(first + b * q->bucket);
+		printf("\t%llu\n", (unsigned long long) counts[b]);
+	}
+	/* Percentiles are over every bucket in the range, including empty ones. */
+	qsort(counts, nbuckets, sizeof *counts, compar_u64);
+	printf("requests per %llds, over %llu bucket(s): p50 %llu, p90 %llu, p99 %llu, max %llu\n",
+		(long long) q->bucket, (unsigned long long) nbuckets,
+		(unsigned long long) counts[nbuckets * 50 / 100],
+		(unsigned long long) counts[nbuckets * 90 / 100],
+		(unsigned long long) counts[nbuckets * 99 / 100],
+		(unsigned long long) counts[nbuckets - 1]);
+	free(counts);
+}
+
+struct tally
+{
+	const char *name;
+	unsigned project;
+	uint64_t nsubmit;
+	uint64_t nfeedback;
+	uint64_t nfailed;
+	uint64_t nunknown;
+};
+
+static int compar_tally(const void *p1, const void *p2)
+{
+	const struct tally *t1 = p1, *t2 = p2;
+	uint64_t n1 = t1->nsubmit + t1->nfeedback, n2 = t2->nsubmit + t2->nfeedback;
+	if (n1 != n2) return (n1 < n2) ? 1 : -1;
+	return t1->name ? strcmp(t1->name, t2->name) : (int) t1->project - (int) t2->project;
+}
+
+static void query_tally(const struct summary *s, const struct audit_query *q, _Bool by_user)
+{
+	uint8_t *outcome = attribute_outcomes(s);
+	size_t n = by_user ? s->nusers + 1 : 256;
+	struct tally *tallies = calloc(n, sizeof *tallies);
+	if (!tallies) err(EXIT_FAILURE, "allocating tallies");
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (by_user) tallies[i].name = (i < s->nusers) ? s->users[i] : "(unknown)";
+		else tallies[i].project = i;
+	}
+	for (uint64_t i = 0; i < s->nrows; ++i)
+	{
+		if (!selected(s, q, i)) continue;
+		struct tally *t = &tallies[by_user ? ((s->user[i] == NO_USER) ? s->nusers : s->user[i])
+			: s->project[i]];
+		if (s->kind[i] == KIND_SUBMIT) ++t->nsubmit; else ++t->nfeedback;
+		if (OUTCOME_FAILED(outcome[i])) ++t->nfailed;
+		if (OUTCOME_UNKNOWN(outcome[i])) ++t->nunknown;
+	}
+	qsort(tallies, n, sizeof *tallies, compar_tally);
+	/* fail% is of the requests whose outcome we know. */
+	printf("%-20s %10s %10s %10s %10s %8s\n", by_user ? "user" : "project",
+		"submit", "feedback", "failed", "unknown", "fail%");
+	for (size_t i = 0; i < n; ++i)
+	{
+		uint64_t total = tallies[i].nsubmit + tallies[i].nfeedback;
+		if (!total) continue;
+		if (by_user) printf("%-20s", tallies[i].name); else printf("%-20u", tallies[i].project);
+		printf(" %10llu %10llu %10llu %10llu", (unsigned long long) tallies[i].nsubmit,
+			(unsigned long long) tallies[i].nfeedback, (unsigned long long) tallies[i].nfailed,
+			(unsigned long long) tallies[i].nunknown);
+		uint64_t known = total - tallies[i].nunknown;
+		if (known) printf(" %7.1f%%\n", 100.0 * tallies[i].nfailed / known);
+		else printf(" %8s\n", "-");
+	}
+	free(tallies);
+	free(outcome);
+}
+
+/* Accept "YYYY-MM-DD", "YYYY-MM-DD HH:MM" or "YYYY-MM-DD HH:MM:SS" (UTC). */
+static int64_t parse_time_arg(const char *arg)
+{
+	char buf[20] = "0000-00-00 00:00:00";
+	size_t len = strlen(arg);
+	if (len != 10 && len != 16 && len != 19) errx(EXIT_FAILURE, "bad time: %s", arg);
+	memcpy(buf, arg, len);
+	int64_t t;
+	if (!parse_timestamp(buf, sizeof buf - 1, &t)) errx(EXIT_FAILURE, "bad time: %s", arg);
+	return t;
+}
+
+int audit_main(int argc, char **argv)
+{
+	struct audit_query q = { INT64_MIN, INT64_MAX, 0, 60 };
+	int opt;
+	while (-1 != (opt = getopt(argc, argv, "s:u:p:b:")))
+	{
+		switch (opt)
+		{
+			case 's': q.since = parse_time_arg(optarg); break;
+			case 'u': q.until = parse_time_arg(optarg); break;
+			case 'p': q.project = atoi(optarg); break;
+			case 'b': q.bucket = atoll(optarg); break;
+			default: goto usage;
+		}
+	}
+	if (q.bucket <= 0) goto usage;
+	const char *what = (optind < argc) ? argv[optind] : "summary";
+	if (optind + 1 < argc) goto usage;
+	if (0 != strcmp(what, "summary") && 0 != strcmp(what, "rate")
+			&& 0 != strcmp(what, "users") && 0 != strcmp(what, "projects")) goto usage;
+
+	struct summary s = { .nsegments = 0 };
+	summary_load(&s);
+	uint64_t nrows_before = s.nrows;
+	summary_update(&s);
+	summary_save(&s);
+	if (isatty(fileno(stderr)))
+	{
+		warnx("%llu new row(s) summarised; %llu in total",
+			(unsigned long long) (s.nrows - nrows_before), (unsigned long long) s.nrows);
+	}
+
+	if (0 == strcmp(what, "summary")) query_summary(&s, &q);
+	else if (0 == strcmp(what, "rate")) query_rate(&s, &q);
+	else if (0 == strcmp(what, "users")) query_tally(&s, &q, 1);
+	else query_tally(&s, &q, 0);
+	return 0;
+usage:
+	errx(EXIT_FAILURE, "Usage: %s [-s since] [-u until] [-p project] [-b bucket-seconds]"
+		" [summary|rate|users|projects]\n"
+		"    times are UTC, as YYYY-MM-DD[ HH:MM[:SS]]", argv[0]);
+}
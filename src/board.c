@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "submit.h"
+
+#define stringify_(t) #t
+#define stringify(t) stringify_(t)
+
+/* The board lives in POSIX shared memory rather than in the submissions
+ * directory: the latter may well be on NFS, where shared mappings are not
+ * coherent. So afb-top only sees requests on the machine it runs on. */
+static const char board_name[] = "/afb-" stringify(MODULE) "-board";
+
+#define BOARD_MAGIC 0xafb0b0a4u
+#define BOARD_NSLOTS 128
+#define BOARD_USER_LEN 32
+#define BOARD_MODE_LEN 12
+
+/* Every field is read and written with __atomic builtins. A slot is
+ * claimed by CAS'ing its pid from zero (or from a dead process's pid) to
+ * ours; it becomes visible to readers only when its phase is stored
+ * (with release semantics) after the other fields are filled in. */
+struct board_slot
+{
+	pid_t pid;
+	unsigned phase;
+	unsigned project;
+	unsigned holds_audit_lock;
+	unsigned long bytes;
+	long long started_ms;
+	char user[BOARD_USER_LEN];
+	char mode[BOARD_MODE_LEN];
+};
+
+struct board
+{
+	unsigned magic;
+	unsigned nslots;
+	unsigned long long nstarted;
+	unsigned long long nsucceeded;
+	unsigned long long nfailed;
+	unsigned long long bytes_total;
+	struct board_slot slots[BOARD_NSLOTS];
+};
+
+static const char *phase_names[PHASE_MAX] = {
+	[PHASE_FREE] = "free",
+	[PHASE_STARTING] = "starting",
+	[PHASE_LOCKING] = "locking",
+	[PHASE_ARCHIVING] = "archiving",
+	[PHASE_SANITY] = "sanity",
+	[PHASE_FINALISING] = "finalising",
+	[PHASE_FEEDBACK] = "feedback"
+};
+
+static struct board *board;
+static struct board_slot *my_slot;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static _Bool pid_is_dead(pid_t pid)
+{
+	/* EPERM means it exists but isn't ours to signal. */
+	return pid != 0 && kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Map the board, creating it if necessary. We must be running with the
+ * lecturer's euid, so that it comes out owned by (and private to) them. */
+static struct board *board_map(void)
+{
+	int fd = shm_open(board_name, O_RDWR | O_CREAT, 0600);
+	if (fd == -1) return NULL;
+	struct stat s;
+	if (fstat(fd, &s) != 0 || s.st_uid != LECTURER_UID) { close(fd); return NULL; }
+	/* Concurrent creators will both truncate to the same size; that's fine. */
+	if (s.st_size < sizeof (struct board)
+			&& ftruncate(fd, sizeof (struct board)) != 0) { close(fd); return NULL; }
+	void *mapping = mmap(NULL, sizeof (struct board), PROT_READ | PROT_WRITE,
+		MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return NULL;
+	struct board *b = mapping;
+	unsigned expected = 0;
+	if (!__atomic_compare_exchange_n(&b->magic, &expected, BOARD_MAGIC, 0,
+			__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) && expected != BOARD_MAGIC)
+	{
+		/* Someone else's layout. Leave it alone. */
+		munmap(mapping, sizeof (struct board));
+		return NULL;
+	}
+	__atomic_store_n(&b->nslots, BOARD_NSLOTS, __ATOMIC_RELAXED);
+	return b;
+}
+
+static void board_exit(void)
+{
+	board_leave();
+}
+
+void board_enter(const char *user, unsigned project, const char *mode)
+{
+	if (!board) board = board_map();
+	if (!board) return;
+	pid_t me = getpid();
+	for (unsigned i = 0; i < BOARD_NSLOTS && !my_slot; ++i)
+	{
+		struct board_slot *slot = &board->slots[i];
+		pid_t seen = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+		/* Slots left behind by processes that died without cleaning up
+		 * (e.g. killed by a signal) are up for grabs. */
+		if (seen != 0 && !pid_is_dead(seen)) continue;
+		if (__atomic_compare_exchange_n(&slot->pid, &seen, me, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) my_slot = slot;
+	}
+	if (!my_slot) return; // board full; carry on regardless
+	__atomic_store_n(&my_slot->phase, PHASE_FREE, __ATOMIC_RELAXED);
+	__atomic_store_n(&my_slot->project, project, __ATOMIC_RELAXED);
+	__atomic_store_n(&my_slot->holds_audit_lock, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&my_slot->bytes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&my_slot->started_ms, now_ms(), __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < BOARD_USER_LEN; ++i)
+	{
+		char c = (user && i < BOARD_USER_LEN - 1) ? user[i] : '\0';
+		__atomic_store_n(&my_slot->user[i], c, __ATOMIC_RELAXED);
+		if (c == '\0') user = NULL;
+	}
+	for (unsigned i = 0; i < BOARD_MODE_LEN; ++i)
+	{
+		char c = (mode && i < BOARD_MODE_LEN - 1) ? mode[i] : '\0';
+		__atomic_store_n(&my_slot->mode[i], c, __ATOMIC_RELAXED);
+		if (c == '\0') mode = NULL;
+	}
+	__atomic_fetch_add(&board->nstarted, 1, __ATOMIC_RELAXED);
+	board_phase(PHASE_STARTING);
+	atexit(board_exit);
+}
+
+void board_phase(enum board_phase phase)
+{
+	if (!my_slot) return;
+	__atomic_store_n(&my_slot->phase, phase, __ATOMIC_RELEASE);
+}
+
+void board_audit_lock(_Bool held)
+{
+	if (!my_slot) return;
+	__atomic_store_n(&my_slot->holds_audit_lock, held, __ATOMIC_RELEASE);
+}
+
+void board_bytes(unsigned long bytes)
+{
+	if (!my_slot) return;
+	__atomic_store_n(&my_slot->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void board_leave(void)
+{
+	/* Beware: forked helpers inherit our atexit handlers. Only the
+	 * process that claimed the slot may release it. */
+	if (!my_slot || __atomic_load_n(&my_slot->pid, __ATOMIC_ACQUIRE) != getpid()) return;
+	__atomic_fetch_add(audit_success ? &board->nsucceeded : &board->nfailed, 1,
+		__ATOMIC_RELAXED);
+	__atomic_fetch_add(&board->bytes_total,
+		__atomic_load_n(&my_slot->bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+	__atomic_store_n(&my_slot->phase, PHASE_FREE, __ATOMIC_RELEASE);
+	__atomic_store_n(&my_slot->pid, 0, __ATOMIC_RELEASE);
+	my_slot = NULL;
+}
+
+/* Requests running longer than this get flagged in the display. */
+#ifndef BOARD_STUCK_SECS
+#define BOARD_STUCK_SECS 60
+#endif
+
+static void board_print(const struct board *prev, double interval)
+{
+	struct board *b = board;
+	unsigned long long nstarted = __atomic_load_n(&b->nstarted, __ATOMIC_RELAXED);
+	unsigned long long nsucceeded = __atomic_load_n(&b->nsucceeded, __ATOMIC_RELAXED);
+	unsigned long long nfailed = __atomic_load_n(&b->nfailed, __ATOMIC_RELAXED);
+	unsigned long long bytes_total = __atomic_load_n(&b->bytes_total, __ATOMIC_RELAXED);
+	time_t t = time(NULL);
+	char datebuf[64];
+	strftime(datebuf, sizeof datebuf, "%F %T", localtime(&t));
+	printf("afb-top (" stringify(MODULE) ") %s\n", datebuf);
+	printf("requests: %llu started, %llu succeeded, %llu failed, %llu bytes archived\n",
+		nstarted, nsucceeded, nfailed, bytes_total);
+	if (prev && interval > 0)
+	{
+		printf("rates: %.1f started/s, %.1f finished/s, %.1f kB/s archived\n",
+			(nstarted - prev->nstarted) / interval,
+			((nsucceeded + nfailed) - (prev->nsucceeded + prev->nfailed)) / interval,
+			(bytes_total - prev->bytes_total) / 1024.0 / interval);
+	}
+	printf("\n%8s %-16s %4s %-10s %-10s %4s %10s %8s\n",
+		"PID", "USER", "PROJ", "MODE", "PHASE", "LOCK", "BYTES", "ELAPSED");
+	long long now = now_ms();
+	unsigned nactive = 0;
+	for (unsigned i = 0; i < BOARD_NSLOTS; ++i)
+	{
+		const struct board_slot *slot = &b->slots[i];
+		unsigned phase = __atomic_load_n(&slot->phase, __ATOMIC_ACQUIRE);
+		pid_t pid = __atomic_load_n(&slot->pid, __ATOMIC_ACQUIRE);
+		if (phase == PHASE_FREE || phase >= PHASE_MAX || pid == 0) continue;
+		char user[BOARD_USER_LEN];
+		char mode[BOARD_MODE_LEN];
+		for (unsigned j = 0; j < BOARD_USER_LEN; ++j)
+			user[j] = __atomic_load_n(&slot->user[j], __ATOMIC_RELAXED);
+		for (unsigned j = 0; j < BOARD_MODE_LEN; ++j)
+			mode[j] = __atomic_load_n(&slot->mode[j], __ATOMIC_RELAXED);
+		user[BOARD_USER_LEN - 1] = '\0';
+		mode[BOARD_MODE_LEN - 1] = '\0';
+		double elapsed = (now - __atomic_load_n(&slot->started_ms, __ATOMIC_RELAXED)) / 1000.0;
+		printf("%8ld %-16s %4u %-10s %-10s %4s %10lu %7.1fs%s\n",
+			(long) pid, user,
+			__atomic_load_n(&slot->project, __ATOMIC_RELAXED),
+			mode, phase_names[phase],
+			__atomic_load_n(&slot->holds_audit_lock, __ATOMIC_RELAXED) ? "*" : "",
+			__atomic_load_n(&slot->bytes, __ATOMIC_RELAXED),
+			elapsed,
+			pid_is_dead(pid) ? "  (dead)" : (elapsed > BOARD_STUCK_SECS) ? "  (stuck?)" : "");
+		++nactive;
+	}
+	printf("\n%u request(s) in flight\n", nactive);
+	fflush(stdout);
+}
+
+int board_top(int argc, char **argv)
+{
+	/* Usage: afb-top [interval-seconds]. If stdout is not a terminal,
+	 * we print one snapshot and exit, which is handy for cron/logging. */
+	double interval = (argc > 1) ? atof(argv[1]) : 1.0;
+	if (interval <= 0) errx(EXIT_FAILURE, "Usage: %s [interval-seconds]", argv[0]);
+	board = board_map();
+	if (!board) errx(EXIT_FAILURE, "could not map the request board %s", board_name);
+	_Bool once = !isatty(fileno(stdout));
+	struct board prev;
+	_Bool have_prev = 0;
+	while (1)
+	{
+		if (!once) printf("\x1b[H\x1b[2J");
+		board_print(have_prev ? &prev : NULL, interval);
+		if (once) break;
+		prev.nstarted = __atomic_load_n(&board->nstarted, __ATOMIC_RELAXED);
+		prev.nsucceeded = __atomic_load_n(&board->nsucceeded, __ATOMIC_RELAXED);
+		prev.nfailed = __atomic_load_n(&board->nfailed, __ATOMIC_RELAXED);
+		prev.bytes_total = __atomic_load_n(&board->bytes_total, __ATOMIC_RELAXED);
+		have_prev = 1;
+		struct timespec ts = { (time_t) interval,
+			(long) ((interval - (time_t) interval) * 1e9) };
+		nanosleep(&ts, NULL);
+	}
+	return 0;
+}
@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "submit.h"
+
+/* 'collect <n> <outdir>': for marking. For each student, find their latest
+ * submission for project <n> and their latest one made by their (possibly
+ * extended) deadline, and hardlink them into
+ *     <outdir>/latest/<user>.<ext>
+ *     <outdir>/ontime/<user>.<ext>
+ * also printing a tab-separated summary on stdout. We read the submissions
+ * directory exactly once, picking up both the submissions and the
+ * deadline-<n>[-<user>] files that check_submission_deadline() looks at.
+ * Hardlinking means we never read the submissions' contents, and re-running
+ * into the same <outdir> only touches the links that changed. Submissions
+ * that packsub has moved into the project's pack can't be linked, so are
+ * copied out instead, keeping their mtime so that re-runs can skip them. */
+
+#ifndef COLLECT_NTHREADS
+#define COLLECT_NTHREADS 8
+#endif
+
+struct collect_entry
+{
+	char *name;
+	const char *user;  /* points into name; NULL for the general deadline */
+	size_t userlen;
+	struct timespec mtime;
+	int stat_errno;
+	const struct pack_entry *packed; /* NULL if loose */
+};
+
+struct collect_list
+{
+	struct collect_entry *entries;
+	size_t n;
+	size_t cap;
+};
+
+static void collect_push(struct collect_list *l, char *name, const char *user, size_t userlen)
+{
+	if (l->n == l->cap)
+	{
+		l->cap = l->cap ? 2 * l->cap : 256;
+		l->entries = realloc(l->entries, l->cap * sizeof *l->entries);
+		if (!l->entries) err(EXIT_FAILURE, "allocating collect list");
+	}
+	l->entries[l->n++] = (struct collect_entry) { .name = name, .user = user, .userlen = userlen };
+}
+
+/* Is this the name of a submission for project num? If so, find the user. */
+_Bool parse_submission_name(const char *name, unsigned num,
+	const char **user_out, size_t *userlen_out)
+{
+	char *end;
+	if (name[0] < '0' || name[0] > '9') return 0;
+	unsigned long n = strtoul(name, &end, 10);
+	if (n != num || *end != '-') return 0;
+	const char *user = end + 1;
+	size_t len = strlen(user);
+	size_t extlen = strlen(submission_format_ext);
+	if (len < extlen + 1 || user[len - extlen - 1] != '.'
+			|| 0 != strcmp(user + len - extlen, submission_format_ext)) return 0;
+	/* The identifier never contains a '-', so the user is everything
+	 * up to the last one. */
+	const char *last_dash = memrchr(user, '-', len - extlen - 1);
+	if (!last_dash || last_dash == user) return 0;
+	*user_out = user;
+	*userlen_out = last_dash - user;
+	return 1;
+}
+
+/* Is this deadline-<num> or deadline-<num>-<user>? */
+_Bool parse_deadline_name(const char *name, unsigned num,
+	const char **user_out, size_t *userlen_out)
+{
+	static const char prefix[] = "deadline-";
+	if (0 != strncmp(name, prefix, sizeof prefix - 1)) return 0;
+	const char *digits = name + sizeof prefix - 1;
+	if (*digits < '0' || *digits > '9') return 0;
+	char *end;
+	unsigned long n = strtoul(digits, &end, 10);
+	if (n != num) return 0;
+	if (*end == '\0') { *user_out = NULL; *userlen_out = 0; return 1; }
+	if (*end != '-' || end[1] == '\0') return 0;
+	*user_out = end + 1;
+	*userlen_out = strlen(end + 1);
+	return 1;
+}
+
+/* Every submit holds the audit log lock from creating its submission file
+ * until it has finished writing it (or has unlinked it as insane). So a
+ * tool that holds the lock sees only complete, sane submission files.
+ * Unlike submit, we wait for it rather than give up. Closing the returned
+ * fd releases the lock. */
+int lock_audit_log(int subsfd)
+{
+	int fd = openat(subsfd, "audit.log", O_WRONLY | O_APPEND | O_CREAT, 0644);
+	if (fd == -1) err(EXIT_FAILURE, "opening audit log");
+	if (0 != flock(fd, LOCK_EX | LOCK_NB))
+	{
+		if (errno != EWOULDBLOCK) err(EXIT_FAILURE, "locking audit log");
+		warnx("waiting for in-flight requests to finish...");
+		if (0 != flock(fd, LOCK_EX)) err(EXIT_FAILURE, "locking audit log");
+	}
+	return fd;
+}
+
+struct stat_job
+{
+	int dirfd;
+	struct collect_entry *entries;
+	size_t n;
+	unsigned stride;
+	unsigned start;
+	int flags; /* for fstatat() */
+};
+
+static void *stat_worker(void *arg)
+{
+	struct stat_job *job = arg;
+	for (size_t i = job->start; i < job->n; i += job->stride)
+	{
+		struct stat s;
+		int ret = fstatat(job->dirfd, job->entries[i].name, &s, job->flags);
+		job->entries[i].stat_errno = (ret == 0) ? 0 : errno;
+		if (ret == 0) job->entries[i].mtime = s.st_mtim;
+	}
+	return NULL;
+}
+
+/* The stats are the part that is slow on NFS, so we overlap them. */
+static void stat_all(int dirfd, struct collect_entry *entries, size_t n, int flags)
+{
+	pthread_t threads[COLLECT_NTHREADS];
+	struct stat_job jobs[COLLECT_NTHREADS];
+	unsigned nthreads = (n < COLLECT_NTHREADS) ? (n ? n : 1) : COLLECT_NTHREADS;
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		jobs[i] = (struct stat_job) { dirfd, entries, n, nthreads, i, flags };
+		int ret = pthread_create(&threads[i], NULL, stat_worker, &jobs[i]);
+		if (ret != 0) { errno = ret; err(EXIT_FAILURE, "creating stat thread"); }
+	}
+	for (unsigned i = 0; i < nthreads; ++i) pthread_join(threads[i], NULL);
+}
+
+static int compar_timespec(const struct timespec *t1, const struct timespec *t2)
+{
+	if (t1->tv_sec != t2->tv_sec) return (t1->tv_sec < t2->tv_sec) ? -1 : 1;
+	if (t1->tv_nsec != t2->tv_nsec) return (t1->tv_nsec < t2->tv_nsec) ? -1 : 1;
+	return 0;
+}
+
+static int compar_user(const struct collect_entry *e1, const struct collect_entry *e2)
+{
+	size_t len = (e1->userlen < e2->userlen) ? e1->userlen : e2->userlen;
+	int ret = memcmp(e1->user, e2->user, len);
+	if (ret != 0) return ret;
+	return (e1->userlen > e2->userlen) - (e1->userlen < e2->userlen);
+}
+
+/* Order by user, then by time, then by name (for determinism). */
+static int compar_entry(const void *p1, const void *p2)
+{
+	const struct collect_entry *e1 = p1, *e2 = p2;
+	int ret = compar_user(e1, e2);
+	if (ret != 0) return ret;
+	ret = compar_timespec(&e1->mtime, &e2->mtime);
+	if (ret != 0) return ret;
+	return strcmp(e1->name, e2->name);
+}
+
+/* Copy a packed submission out to linkname in the farm, unless the one
+ * already there (not a link to some loose submission) looks the same. */
+static _Bool update_copy(const struct pack *p, const struct collect_entry *e, int farmfd,
+	const char *linkname, const struct stat *existing)
+{
+	if (existing && existing->st_nlink == 1 && existing->st_size == e->packed->size
+			&& 0 == compar_timespec(&existing->st_mtim, &e->mtime))
+	{
+		return 0; // up to date
+	}
+	if (existing && 0 != unlinkat(farmfd, linkname, 0))
+		err(EXIT_FAILURE, "removing stale %s", linkname);
+	int fd = openat(farmfd, linkname, O_WRONLY | O_CREAT | O_EXCL, 0640);
+	if (fd == -1) err(EXIT_FAILURE, "creating %s", linkname);
+	if (0 != pack_extract(p, e->packed, fd)) err(EXIT_FAILURE, "extracting %s from pack", e->name);
+	struct timespec times[2] = { e->mtime, e->mtime };
+	if (0 != futimens(fd, times)) err(EXIT_FAILURE, "setting times on %s", linkname);
+	close(fd);
+	return 1;
+}
+
+/* Make <outdir>/<sub>/<user>.<ext> a hardlink to the submission e (or a
+ * copy, if it's packed), or remove it if e is NULL. Returns 1 if anything
+ * changed. */
+static _Bool update_link(int subsfd, const struct pack *p, const struct collect_entry *e,
+	int farmfd, const char *user, size_t userlen)
+{
+	const char *name = e ? e->name : NULL;
+	char *linkname;
+	int ret = asprintf(&linkname, "%.*s.%s", (int) userlen, user, submission_format_ext);
+	if (ret < 0) errx(EXIT_FAILURE, "printing link name");
+	_Bool changed = 0;
+	struct stat existing, target;
+	_Bool have_existing = (0 == fstatat(farmfd, linkname, &existing, AT_SYMLINK_NOFOLLOW));
+	if (!name)
+	{
+		if (have_existing && 0 != unlinkat(farmfd, linkname, 0))
+			err(EXIT_FAILURE, "removing stale %s", linkname);
+		changed = have_existing;
+		goto out;
+	}
+	if (e->packed)
+	{
+		changed = update_copy(p, e, farmfd, linkname, have_existing ? &existing : NULL);
+		goto out;
+	}
+	ret = fstatat(subsfd, name, &target, AT_SYMLINK_NOFOLLOW);
+	if (ret != 0) err(EXIT_FAILURE, "stat'ing %s", name);
+	if (have_existing && existing.st_dev == target.st_dev && existing.st_ino == target.st_ino)
+	{
+		goto out; // up to date
+	}
+	if (have_existing && 0 != unlinkat(farmfd, linkname, 0))
+		err(EXIT_FAILURE, "removing stale %s", linkname);
+	ret = linkat(subsfd, name, farmfd, linkname, 0);
+	if (ret != 0) err(EXIT_FAILURE, "linking %s (is the output directory on the same filesystem?)", name);
+	changed = 1;
+out:
+	free(linkname);
+	return changed;
+}
+
+static int open_farm_dir(int parentfd, const char *name)
+{
+	int ret = mkdirat(parentfd, name, 0750);
+	if (ret != 0 && errno != EEXIST) err(EXIT_FAILURE, "creating directory %s", name);
+	int fd = openat(parentfd, name, O_RDONLY | O_DIRECTORY);
+	if (fd == -1) err(EXIT_FAILURE, "opening directory %s", name);
+	return fd;
+}
+
+static void print_time(FILE *f, const struct timespec *t)
+{
+	char buf[64];
+	struct tm tm;
+	strftime(buf, sizeof buf, "%F %T", localtime_r(&t->tv_sec, &tm));
+	fputs(buf, f);
+}
+
+int collect_main(unsigned num, int argc, char **argv)
+{
+	if (argc != 3) errx(EXIT_FAILURE, "Usage: %s <n> <output-directory>", argv[0]);
+	const char *outdir = argv[2];
+
+	DIR *subsdir = opendir(submissions_path_prefix);
+	if (!subsdir) err(EXIT_FAILURE, "opening submissions directory %s", submissions_path_prefix);
+	int subsfd = dirfd(subsdir);
+
+	/* Hold the audit lock from the scan until we have finished linking,
+	 * so we never link (and so keep alive) a half-written or insane file. */
+	int auditfd = lock_audit_log(subsfd);
+
+	/* One pass over the directory to classify the names... */
+	struct collect_list subs = { NULL, 0, 0 };
+	struct collect_list deadlines = { NULL, 0, 0 };
+	struct dirent *the_entry;
+	while (NULL != (the_entry = readdir(subsdir)))
+	{
+		/* Deadline files may be symlinks (e.g. to share an extension
+		 * date); submit follows them, so we must too. */
+		_Bool is_link = (the_entry->d_type == DT_LNK);
+		if (the_entry->d_type != DT_REG && the_entry->d_type != DT_UNKNOWN && !is_link) continue;
+		const char *user;
+		size_t userlen;
+		struct collect_list *l;
+		if (!is_link && parse_submission_name(the_entry->d_name, num, &user, &userlen)) l = &subs;
+		else if (parse_deadline_name(the_entry->d_name, num, &user, &userlen)) l = &deadlines;
+		else continue;
+		char *name = strdup(the_entry->d_name);
+		if (!name) err(EXIT_FAILURE, "strdup");
+		/* Re-point user into our copy. */
+		collect_push(l, name, user ? name + (user - the_entry->d_name) : NULL, userlen);
+	}
+	/* ... then get their timestamps. */
+	stat_all(subsfd, subs.entries, subs.n, AT_SYMLINK_NOFOLLOW);
+	stat_all(subsfd, deadlines.entries, deadlines.n, 0);
+	/* Packed submissions come with theirs. */
+	struct pack *p = pack_open(num);
+	for (size_t i = 0; p && i < p->nentries; ++i)
+	{
+		const struct pack_entry *pe = &p->entries[i];
+		const char *user;
+		size_t userlen;
+		if (!parse_submission_name(pe->name, num, &user, &userlen)) continue;
+		char *name = strdup(pe->name);
+		if (!name) err(EXIT_FAILURE, "strdup");
+		collect_push(&subs, name, name + (user - pe->name), userlen);
+		subs.entries[subs.n - 1].mtime = (struct timespec) { pe->mtime_sec, pe->mtime_nsec };
+		subs.entries[subs.n - 1].packed = pe;
+	}
+
+	struct timespec general_deadline;
+	_Bool have_general_deadline = 0;
+	size_t npersonal = 0;
+	for (size_t i = 0; i < deadlines.n; ++i)
+	{
+		if (deadlines.entries[i].stat_errno == 0 && deadlines.entries[i].user)
+		{
+			deadlines.entries[npersonal++] = deadlines.entries[i];
+			continue;
+		}
+		if (deadlines.entries[i].stat_errno == 0)
+		{
+			general_deadline = deadlines.entries[i].mtime;
+			have_general_deadline = 1;
+		}
+		free(deadlines.entries[i].name);
+	}
+	if (!have_general_deadline) warnx("No deadline defined for project %u; everything is on time", num);
+	qsort(deadlines.entries, npersonal, sizeof *deadlines.entries, compar_entry);
+	qsort(subs.entries, subs.n, sizeof *subs.entries, compar_entry);
+
+	int ret = mkdir(outdir, 0750);
+	if (ret != 0 && errno != EEXIST) err(EXIT_FAILURE, "creating output directory %s", outdir);
+	int outfd = open(outdir, O_RDONLY | O_DIRECTORY);
+	if (outfd == -1) err(EXIT_FAILURE, "opening output directory %s", outdir);
+	int latestfd = open_farm_dir(outfd, "latest");
+	int ontimefd = open_farm_dir(outfd, "ontime");
+
+	printf("user\tlatest\tlatest_time\tontime\tontime_time\tdeadline\n");
+	unsigned nusers = 0, nlate = 0, nchanged = 0;
+	for (size_t i = 0; i < subs.n; )
+	{
+		/* Find this user's run of submissions, oldest first. */
+		size_t end = i;
+		while (end < subs.n && 0 == compar_user(&subs.entries[i], &subs.entries[end])) ++end;
+		const struct collect_entry *first = &subs.entries[i];
+		struct timespec deadline = general_deadline;
+		_Bool have_deadline = have_general_deadline;
+		const struct collect_entry *personal = bsearch(first, deadlines.entries, npersonal,
+			sizeof *deadlines.entries, (int (*)(const void *, const void *)) compar_user);
+		if (personal) { deadline = personal->mtime; have_deadline = 1; }
+		const struct collect_entry *latest = NULL, *ontime = NULL;
+		for (size_t j = i; j < end; ++j)
+		{
+			if (subs.entries[j].stat_errno != 0) continue; // vanished under us
+			latest = &subs.entries[j];
+			/* Whole seconds, as check_submission_deadline() compares. */
+			if (!have_deadline || latest->mtime.tv_sec <= deadline.tv_sec) ontime = latest;
+		}
+		i = end;
+		if (!latest) continue;
+		++nusers;
+		if (ontime != latest) ++nlate;
+		nchanged += update_link(subsfd, p, latest, latestfd, first->user, first->userlen);
+		nchanged += update_link(subsfd, p, ontime, ontimefd,
+			first->user, first->userlen);
+		printf("%.*s\t%s\t", (int) first->userlen, first->user, latest->name);
+		print_time(stdout, &latest->mtime);
+		printf("\t%s\t", ontime ? ontime->name : "-");
+		if (ontime) print_time(stdout, &ontime->mtime); else printf("-");
+		printf("\t");
+		if (have_deadline) print_time(stdout, &deadline); else printf("-");
+		printf("%s\n", personal ? " (extended)" : "");
+	}
+	close(auditfd); // releases the lock
+	warnx("%u user(s), %u with a late final submission; %u link(s) updated in %s",
+		nusers, nlate, nchanged, outdir);
+
+	for (size_t i = 0; i < subs.n; ++i) free(subs.entries[i].name);
+	for (size_t i = 0; i < npersonal; ++i) free(deadlines.entries[i].name);
+	free(subs.entries);
+	free(deadlines.entries);
+	pack_close(p);
+	close(latestfd);
+	close(ontimefd);
+	close(outfd);
+	closedir(subsdir);
+	return 0;
+}
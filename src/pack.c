@@ -0,0 +1,422 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "submit.h"
+
+/* Pack files. Once a project is closed, 'packsub <n>' moves its loose
+ * %02d-<user>-XXXXXX.<ext> submissions into a single pack-<nn>.afbpack in
+ * the submissions directory, so that directory scans, backups and lssub's
+ * find don't slow down as the term goes on. The layout is
+ *
+ *     header:  "AFBPACK1", uint32 version, uint32 reserved
+ *     blobs:   each submission's bytes, back to back
+ *     index:   nentries struct pack_entry, sorted by name
+ *     trailer: uint64 index offset, uint64 nentries, "AFBPIDX1"
+ *
+ * in native byte order (packs never leave the machine that wrote them).
+ * Each entry keeps its original name, mtime (which is what deadline
+ * checks go by) and owner, so lssub, catsub, collect and replay can treat
+ * packed submissions like loose ones. */
+
+static const char pack_magic[8] = "AFBPACK1";
+static const char pack_index_magic[8] = "AFBPIDX1";
+#define PACK_VERSION 1
+
+struct pack_trailer
+{
+	uint64_t index_offset;
+	uint64_t nentries;
+	char magic[8];
+};
+
+static char *pack_path(unsigned num)
+{
+	char *path;
+	int ret = asprintf(&path, "%s/pack-%02u.afbpack", submissions_path_prefix, num);
+	if (ret < 0) errx(EXIT_FAILURE, "printing pack path");
+	return path;
+}
+
+struct pack *pack_open(unsigned num)
+{
+	char *path = pack_path(num);
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+	{
+		if (errno != ENOENT) warn("opening pack %s", path);
+		free(path);
+		return NULL;
+	}
+	struct pack *p = calloc(1, sizeof *p);
+	if (!p) err(EXIT_FAILURE, "allocating pack");
+	p->fd = fd;
+	struct stat s;
+	struct pack_trailer trailer;
+	char magic[8];
+	if (fstat(fd, &s) != 0
+			|| s.st_size < (off_t) (sizeof magic + 8 + sizeof trailer)
+			|| pread(fd, magic, sizeof magic, 0) != sizeof magic
+			|| 0 != memcmp(magic, pack_magic, sizeof magic)
+			|| pread(fd, &trailer, sizeof trailer, s.st_size - sizeof trailer) != sizeof trailer
+			|| 0 != memcmp(trailer.magic, pack_index_magic, sizeof trailer.magic)
+			|| trailer.index_offset + trailer.nentries * sizeof (struct pack_entry)
+				!= s.st_size - sizeof trailer)
+	{
+		errx(EXIT_FAILURE, "%s is not a valid pack file", path);
+	}
+	p->nentries = trailer.nentries;
+	p->entries = malloc(p->nentries * sizeof *p->entries + 1);
+	if (!p->entries) err(EXIT_FAILURE, "allocating pack index");
+	size_t index_size = p->nentries * sizeof *p->entries;
+	if (pread(fd, p->entries, index_size, trailer.index_offset) != (ssize_t) index_size)
+	{
+		err(EXIT_FAILURE, "reading index of pack %s", path);
+	}
+	for (size_t i = 0; i < p->nentries; ++i)
+	{
+		p->entries[i].name[PACK_NAME_MAX - 1] = '\0'; // be defensive
+	}
+	free(path);
+	return p;
+}
+
+void pack_close(struct pack *p)
+{
+	if (!p) return;
+	close(p->fd);
+	free(p->entries);
+	free(p);
+}
+
+static int compar_pack_entry(const void *p1, const void *p2)
+{
+	return strcmp(((const struct pack_entry *) p1)->name, ((const struct pack_entry *) p2)->name);
+}
+
+const struct pack_entry *pack_lookup(const struct pack *p, const char *name)
+{
+	if (!p || strlen(name) >= PACK_NAME_MAX) return NULL;
+	struct pack_entry key;
+	strcpy(key.name, name);
+	return bsearch(&key, p->entries, p->nentries, sizeof *p->entries, compar_pack_entry);
+}
+
+/* Copy len bytes from infd at offset off (or its current offset, if off
+ * is NULL) to outfd's current offset. sendfile() keeps the data in the
+ * kernel; it can't always be used, so fall back to read/write. */
+static int copy_range(int outfd, int infd, off_t *off, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t n = sendfile(outfd, infd, off, len);
+		if (n == -1 && errno == EINTR) continue;
+		if (n == -1 && (errno == EINVAL || errno == ENOSYS)) break;
+		if (n <= 0) return -1;
+		len -= n;
+	}
+	char buf[65536];
+	while (len > 0)
+	{
+		ssize_t n = off ? pread(infd, buf, (len < sizeof buf) ? len : sizeof buf, *off)
+			: read(infd, buf, (len < sizeof buf) ? len : sizeof buf);
+		if (n == -1 && errno == EINTR) continue;
+		if (n <= 0) return -1;
+		if (off) *off += n;
+		for (ssize_t done = 0; done < n; )
+		{
+			ssize_t w = write(outfd, buf + done, n - done);
+			if (w == -1 && errno == EINTR) continue;
+			if (w <= 0) return -1;
+			done += w;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+int pack_extract(const struct pack *p, const struct pack_entry *e, int outfd)
+{
+	off_t off = e->offset;
+	return copy_range(outfd, p->fd, &off, e->size);
+}
+
+/* Open a submission for reading, whether it's loose or packed. A packed
+ * one gets copied to an unlinked temporary file, so the caller gets an
+ * fd on just that submission, with its offset at the start. */
+int open_submission(int subsfd, const struct pack *p, const char *name)
+{
+	int fd = openat(subsfd, name, O_RDONLY);
+	if (fd != -1 || errno != ENOENT) return fd;
+	const struct pack_entry *e = pack_lookup(p, name);
+	if (!e) { errno = ENOENT; return -1; }
+	char tmp_path[] = "/tmp/afbpack-XXXXXX";
+	fd = mkstemp(tmp_path);
+	if (fd == -1) return -1;
+	unlink(tmp_path);
+	if (0 != pack_extract(p, e, fd) || (off_t) -1 == lseek(fd, 0, SEEK_SET))
+	{
+		int saved_errno = errno;
+		close(fd);
+		errno = saved_errno;
+		return -1;
+	}
+	return fd;
+}
+
+/* Is this pack entry one of the invoking user's? We don't trust USER
+ * alone for this: the submission file was created with the submitter's
+ * gid, and we recorded it. */
+_Bool pack_entry_is_callers(const struct pack_entry *e, unsigned num)
+{
+	const char *user;
+	size_t userlen;
+	return parse_submission_name(e->name, num, &user, &userlen)
+		&& userlen == strlen(submitting_user)
+		&& 0 == strncmp(user, submitting_user, userlen)
+		&& e->gid == rgid;
+}
+
+static int compar_name(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *) p1, *(char * const *) p2);
+}
+
+int pack_main(unsigned num, int argc, char **argv)
+{
+	_Bool force = (argc == 3 && 0 == strcmp(argv[2], "--force"));
+	if (argc > 3 || (argc == 3 && !force)) errx(EXIT_FAILURE, "Usage: %s <n> [--force]", argv[0]);
+
+	DIR *subsdir = opendir(submissions_path_prefix);
+	if (!subsdir) err(EXIT_FAILURE, "opening submissions directory %s", submissions_path_prefix);
+	int subsfd = dirfd(subsdir);
+
+	/* One packsub at a time. (This lock on the directory is ours alone;
+	 * submit doesn't take it.) */
+	if (0 != flock(subsfd, LOCK_EX | LOCK_NB))
+	{
+		err(EXIT_FAILURE, "locking submissions directory (is another packsub running?)");
+	}
+	/* Holding the audit lock while we scan means every loose file we see
+	 * is complete and sane (see lock_audit_log). But submit doesn't wait
+	 * for the lock, so we only hold it while scanning and while removing
+	 * the loose files at the end, not while copying. */
+	int auditfd = lock_audit_log(subsfd);
+
+	/* Find the loose submissions, and check that the project is closed,
+	 * i.e. that no deadline (including extensions) is still to come. */
+	char **loose = NULL;
+	size_t nloose = 0, cap = 0;
+	time_t now = time(NULL);
+	struct dirent *the_entry;
+	while (NULL != (the_entry = readdir(subsdir)))
+	{
+		const char *user;
+		size_t userlen;
+		if (parse_deadline_name(the_entry->d_name, num, &user, &userlen))
+		{
+			struct stat s;
+			if (0 == fstatat(subsfd, the_entry->d_name, &s, 0) && s.st_mtime > now && !force)
+			{
+				errx(EXIT_FAILURE, "project %u is not closed (%s is in the future); "
+					"use --force to pack it anyway", num, the_entry->d_name);
+			}
+			continue;
+		}
+		if (!parse_submission_name(the_entry->d_name, num, &user, &userlen)) continue;
+		if (strlen(the_entry->d_name) >= PACK_NAME_MAX)
+		{
+			warnx("leaving %s loose (name too long to pack)", the_entry->d_name);
+			continue;
+		}
+		if (nloose == cap)
+		{
+			cap = cap ? 2 * cap : 256;
+			loose = realloc(loose, cap * sizeof *loose);
+			if (!loose) err(EXIT_FAILURE, "allocating name list");
+		}
+		loose[nloose] = strdup(the_entry->d_name);
+		if (!loose[nloose++]) err(EXIT_FAILURE, "strdup");
+	}
+	close(auditfd);
+	if (nloose == 0)
+	{
+		warnx("no loose submissions for project %u; nothing to do", num);
+		closedir(subsdir);
+		return 0;
+	}
+	qsort(loose, nloose, sizeof *loose, compar_name);
+	/* What we packed of each loose file, so we can check it is still
+	 * that file before removing it. */
+	struct stat *packed = calloc(nloose, sizeof *packed);
+	if (!packed) err(EXIT_FAILURE, "allocating stat list");
+
+	/* We always write a whole new pack, merging in any existing one,
+	 * then rename it into place. So a crash leaves the old pack and the
+	 * loose files as they were (plus perhaps a stray temporary). */
+	struct pack *old = pack_open(num);
+	char *path = pack_path(num);
+	char *tmp_path;
+	if (asprintf(&tmp_path, "%s.XXXXXX", path) < 0) errx(EXIT_FAILURE, "printing pack path");
+	int fd = mkstemp(tmp_path);
+	if (fd == -1) err(EXIT_FAILURE, "creating %s", tmp_path);
+	if (0 != fchmod(fd, 0640)) err(EXIT_FAILURE, "chmod'ing %s", tmp_path);
+
+	size_t nentries_max = nloose + (old ? old->nentries : 0);
+	struct pack_entry *entries = calloc(nentries_max ? nentries_max : 1, sizeof *entries);
+	if (!entries) err(EXIT_FAILURE, "allocating pack index");
+	size_t nentries = 0;
+	char header[16] = { 0 };
+	memcpy(header, pack_magic, sizeof pack_magic);
+	*(uint32_t *) (header + 8) = PACK_VERSION;
+	if (write(fd, header, sizeof header) != sizeof header) err(EXIT_FAILURE, "writing %s", tmp_path);
+	uint64_t offset = sizeof header;
+
+	for (size_t i = 0; old && i < old->nentries; ++i)
+	{
+		struct pack_entry e = old->entries[i];
+		if (0 != pack_extract(old, &old->entries[i], fd)) err(EXIT_FAILURE, "copying %s", e.name);
+		e.offset = offset;
+		offset += e.size;
+		entries[nentries++] = e;
+	}
+	size_t nfrom_old = nentries;
+	unsigned long long nbytes_loose = 0;
+	for (size_t i = 0; i < nloose; ++i)
+	{
+		/* If a previous packsub died between renaming the pack into place
+		 * and unlinking the loose files, we may see one twice. */
+		const struct pack_entry *already = old ? pack_lookup(old, loose[i]) : NULL;
+		if (already)
+		{
+			packed[i].st_size = already->size;
+			packed[i].st_mtim = (struct timespec) { already->mtime_sec, already->mtime_nsec };
+			continue;
+		}
+		int infd = openat(subsfd, loose[i], O_RDONLY);
+		if (infd == -1) err(EXIT_FAILURE, "opening %s", loose[i]);
+		struct stat s;
+		if (0 != fstat(infd, &s)) err(EXIT_FAILURE, "stat'ing %s", loose[i]);
+		packed[i] = s;
+		struct pack_entry *e = &entries[nentries++];
+		strcpy(e->name, loose[i]);
+		e->offset = offset;
+		e->size = s.st_size;
+		e->mtime_sec = s.st_mtim.tv_sec;
+		e->mtime_nsec = s.st_mtim.tv_nsec;
+		e->uid = s.st_uid;
+		e->gid = s.st_gid;
+		e->mode = s.st_mode;
+		if (0 != copy_range(fd, infd, NULL, s.st_size)) err(EXIT_FAILURE, "copying %s", loose[i]);
+		close(infd);
+		offset += s.st_size;
+		nbytes_loose += s.st_size;
+	}
+	qsort(entries, nentries, sizeof *entries, compar_pack_entry);
+	struct pack_trailer trailer = { offset, nentries };
+	memcpy(trailer.magic, pack_index_magic, sizeof trailer.magic);
+	size_t index_size = nentries * sizeof *entries;
+	if (write(fd, entries, index_size) != (ssize_t) index_size
+			|| write(fd, &trailer, sizeof trailer) != sizeof trailer)
+	{
+		err(EXIT_FAILURE, "writing index of %s", tmp_path);
+	}
+	if (0 != fsync(fd)) err(EXIT_FAILURE, "syncing %s", tmp_path);
+	close(fd);
+
+	/* Swap the loose files for the pack under the lock, so that lssub
+	 * sees each submission exactly once. */
+	auditfd = lock_audit_log(subsfd);
+	if (0 != rename(tmp_path, path)) err(EXIT_FAILURE, "renaming %s to %s", tmp_path, path);
+	if (0 != fsync(subsfd)) warn("syncing submissions directory");
+	/* Only now is it safe to remove the loose files, and only if they
+	 * are still what we packed. */
+	for (size_t i = 0; i < nloose; ++i)
+	{
+		struct stat s;
+		if (0 != fstatat(subsfd, loose[i], &s, AT_SYMLINK_NOFOLLOW))
+		{
+			warn("stat'ing %s", loose[i]);
+		}
+		else if (s.st_size != packed[i].st_size
+				|| s.st_mtim.tv_sec != packed[i].st_mtim.tv_sec
+				|| s.st_mtim.tv_nsec != packed[i].st_mtim.tv_nsec
+				|| (packed[i].st_ino && (s.st_ino != packed[i].st_ino || s.st_dev != packed[i].st_dev)))
+		{
+			warnx("leaving %s loose: it is no longer what we packed", loose[i]);
+		}
+		else if (0 != unlinkat(subsfd, loose[i], 0)) warn("removing %s", loose[i]);
+		free(loose[i]);
+	}
+	close(auditfd); // releases the lock
+	warnx("packed %zu loose submission(s) (%llu bytes) into %s, which now holds %zu",
+		nentries - nfrom_old, nbytes_loose, path, nentries);
+
+	free(loose);
+	free(packed);
+	free(entries);
+	free(tmp_path);
+	free(path);
+	pack_close(old);
+	closedir(subsdir); // releases the directory lock
+	return 0;
+}
+
+/* 'catsub <n> <identifier>': show a student one of their own submissions,
+ * whether it is still loose or has been packed. The latter needs the
+ * lecturer's privileges; the former is read with the student's own. */
+int catsub_main(unsigned num, int argc, char **argv)
+{
+	if (argc != 3) errx(EXIT_FAILURE, "Usage: %s <n> <identifier>", argv[0]);
+	const char *name = argv[2];
+	const char *user;
+	size_t userlen;
+	if (strchr(name, '/') || !parse_submission_name(name, num, &user, &userlen)
+			|| userlen != strlen(submitting_user)
+			|| 0 != strncmp(user, submitting_user, userlen))
+	{
+		errx(EXIT_FAILURE, "%s is not the identifier of one of your submissions for project %u"
+			" (try lssub)", name, num);
+	}
+	struct pack *p = pack_open(num);
+	/* USER is only a claim, so loose files must be opened with nothing
+	 * but the student's own uid and gid. */
+	int ret = setegid(rgid);
+	if (ret != 0) err(EXIT_FAILURE, "setegid(%ld)", (long) rgid);
+	ret = seteuid(ruid);
+	if (ret != 0) err(EXIT_FAILURE, "seteuid(%ld)", (long) ruid);
+
+	char *path;
+	if (asprintf(&path, "%s/%s", submissions_path_prefix, name) < 0)
+		errx(EXIT_FAILURE, "printing submission path");
+	int fd = open(path, O_RDONLY);
+	if (fd != -1)
+	{
+		struct stat s;
+		if (0 != fstat(fd, &s) || 0 != copy_range(STDOUT_FILENO, fd, NULL, s.st_size))
+			err(EXIT_FAILURE, "reading %s", path);
+		close(fd);
+	}
+	else if (errno == ENOENT)
+	{
+		const struct pack_entry *e = pack_lookup(p, name);
+		if (!e || !pack_entry_is_callers(e, num)) errx(EXIT_FAILURE, "no such submission: %s", name);
+		if (0 != pack_extract(p, e, STDOUT_FILENO)) err(EXIT_FAILURE, "reading %s from pack", name);
+	}
+	else err(EXIT_FAILURE, "opening %s", path);
+	free(path);
+	pack_close(p);
+	return 0;
+}
@@ -0,0 +1,242 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include "project.h"
+#include "submit.h"
+
+/* 'replay <n> <script-a> <script-b> [max-samples]': benchmark a change to a
+ * write-feedback script offline. We take an evenly spread sample of the
+ * stored submissions for project <n> and run both scripts on each, through
+ * run_helper() exactly as 'feedback' would (submission on stdin, a
+ * directory on fd 7, an audit stream on fd 8, and the project's
+ * write_feedback_arg as argument), reporting wall and CPU time for each
+ * and whether their outputs differ. Differing outputs are kept for
+ * inspection. Helpers' audit output goes to /dev/null: replays are not
+ * real requests. Packed submissions are sampled along with loose ones. */
+
+#ifndef REPLAY_DEFAULT_SAMPLES
+#define REPLAY_DEFAULT_SAMPLES 20
+#endif
+
+struct replay_run
+{
+	double wall;
+	double cpu;
+	_Bool ok;
+	FILE *out;
+};
+
+static double timeval_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+static double children_cpu_secs(void)
+{
+	struct rusage ru;
+	if (getrusage(RUSAGE_CHILDREN, &ru) != 0) err(EXIT_FAILURE, "getrusage");
+	return timeval_secs(&ru.ru_utime) + timeval_secs(&ru.ru_stime);
+}
+
+static double now_secs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void replay_one(const char *script, const char *argv1, int subsfd,
+	const struct pack *p, const char *name, FILE *auditf, struct replay_run *run)
+{
+	/* Each run gets its own descriptor on the submission, since the
+	 * helper consumes it from stdin, and its own empty scratch directory
+	 * standing in for the student's. */
+	int fd = open_submission(subsfd, p, name);
+	if (fd == -1) err(EXIT_FAILURE, "opening submission %s", name);
+	char scratch[] = "/tmp/replay-dir-XXXXXX";
+	if (!mkdtemp(scratch)) err(EXIT_FAILURE, "creating scratch directory");
+	DIR *dir = opendir(scratch);
+	if (!dir) err(EXIT_FAILURE, "opening scratch directory %s", scratch);
+	run->out = tmpfile();
+	if (!run->out) err(EXIT_FAILURE, "creating output file");
+
+	double cpu_before = children_cpu_secs();
+	double wall_before = now_secs();
+	run->ok = run_helper(script, argv1, dir, auditf, run->out, fd);
+	run->wall = now_secs() - wall_before;
+	run->cpu = children_cpu_secs() - cpu_before;
+
+	closedir(dir);
+	if (0 != rmdir(scratch)) warn("removing scratch directory %s (left behind by %s?)", scratch, script);
+	close(fd);
+}
+
+static _Bool outputs_equal(FILE *f1, FILE *f2)
+{
+	rewind(f1);
+	rewind(f2);
+	char buf1[8192], buf2[8192];
+	while (1)
+	{
+		size_t n1 = fread(buf1, 1, sizeof buf1, f1);
+		size_t n2 = fread(buf2, 1, sizeof buf2, f2);
+		if (n1 != n2 || 0 != memcmp(buf1, buf2, n1)) return 0;
+		if (n1 == 0) return 1;
+	}
+}
+
+static void save_output(FILE *f, const char *dir, const char *name, const char *suffix)
+{
+	char *path;
+	if (asprintf(&path, "%s/%s.%s", dir, name, suffix) < 0) errx(EXIT_FAILURE, "printing output path");
+	FILE *saved = fopen(path, "w");
+	if (!saved) err(EXIT_FAILURE, "creating %s", path);
+	rewind(f);
+	char buf[8192];
+	size_t n;
+	while (0 != (n = fread(buf, 1, sizeof buf, f))) fwrite(buf, 1, n, saved);
+	if (0 != fclose(saved)) err(EXIT_FAILURE, "writing %s", path);
+	free(path);
+}
+
+static void push_name(char ***names, size_t *nnames, size_t *cap, const char *name)
+{
+	if (*nnames == *cap)
+	{
+		*cap = *cap ? 2 * *cap : 256;
+		*names = realloc(*names, *cap * sizeof **names);
+		if (!*names) err(EXIT_FAILURE, "allocating name list");
+	}
+	(*names)[*nnames] = strdup(name);
+	if (!(*names)[(*nnames)++]) err(EXIT_FAILURE, "strdup");
+}
+
+static int compar_str(const void *p1, const void *p2)
+{
+	return strcmp(*(char * const *) p1, *(char * const *) p2);
+}
+
+int replay_main(unsigned num, int argc, char **argv)
+{
+	if (argc < 4 || argc > 5)
+	{
+		errx(EXIT_FAILURE, "Usage: %s <n> <script-a> <script-b> [max-samples]", argv[0]);
+	}
+	const char *scripts[2] = { argv[2], argv[3] };
+	unsigned max_samples = (argc > 4) ? atoi(argv[4]) : REPLAY_DEFAULT_SAMPLES;
+	if (max_samples == 0) errx(EXIT_FAILURE, "bad sample count: %s", argv[4]);
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		if (0 != access(scripts[i], X_OK)) err(EXIT_FAILURE, "script %s", scripts[i]);
+	}
+	/* The scripts get the same argument as under 'feedback'. */
+	const char *argv1 = projects[num]->write_feedback_arg;
+
+	DIR *subsdir = opendir(submissions_path_prefix);
+	if (!subsdir) err(EXIT_FAILURE, "opening submissions directory %s", submissions_path_prefix);
+	char **names = NULL;
+	size_t nnames = 0, cap = 0;
+	struct dirent *the_entry;
+	while (NULL != (the_entry = readdir(subsdir)))
+	{
+		const char *user;
+		size_t userlen;
+		if (!parse_submission_name(the_entry->d_name, num, &user, &userlen)) continue;
+		push_name(&names, &nnames, &cap, the_entry->d_name);
+	}
+	struct pack *p = pack_open(num);
+	for (size_t i = 0; p && i < p->nentries; ++i)
+	{
+		const char *user;
+		size_t userlen;
+		if (!parse_submission_name(p->entries[i].name, num, &user, &userlen)) continue;
+		push_name(&names, &nnames, &cap, p->entries[i].name);
+	}
+	if (nnames == 0) errx(EXIT_FAILURE, "no submissions found for project %u", num);
+	/* Sort so that the sample is stable from one run to the next. */
+	qsort(names, nnames, sizeof *names, compar_str);
+	unsigned nsamples = (nnames < max_samples) ? nnames : max_samples;
+
+	FILE *devnull = fopen("/dev/null", "w");
+	if (!devnull) err(EXIT_FAILURE, "opening /dev/null");
+	char *diffdir = NULL;
+	double total_wall[2] = { 0, 0 }, total_cpu[2] = { 0, 0 };
+	double log_ratio_sum = 0;
+	unsigned nfailed[2] = { 0, 0 }, ndiffering = 0, nratios = 0;
+
+	printf("%-32s %9s %9s %9s %9s %7s  %s\n", "submission",
+		"wall(a)", "wall(b)", "cpu(a)", "cpu(b)", "b/a", "output");
+	for (unsigned i = 0; i < nsamples; ++i)
+	{
+		const char *name = names[(size_t) i * nnames / nsamples];
+		struct replay_run runs[2];
+		/* Alternate which goes first, so neither always gets the
+		 * warmer caches. */
+		unsigned first = i % 2;
+		replay_one(scripts[first], argv1, dirfd(subsdir), p, name, devnull, &runs[first]);
+		replay_one(scripts[!first], argv1, dirfd(subsdir), p, name, devnull, &runs[!first]);
+
+		_Bool same = outputs_equal(runs[0].out, runs[1].out);
+		if (!same)
+		{
+			++ndiffering;
+			if (!diffdir)
+			{
+				diffdir = strdup("/tmp/replay-XXXXXX");
+				if (!diffdir || !mkdtemp(diffdir)) err(EXIT_FAILURE, "creating output directory");
+			}
+			save_output(runs[0].out, diffdir, name, "a");
+			save_output(runs[1].out, diffdir, name, "b");
+		}
+		for (unsigned j = 0; j < 2; ++j)
+		{
+			total_wall[j] += runs[j].wall;
+			total_cpu[j] += runs[j].cpu;
+			if (!runs[j].ok) ++nfailed[j];
+			fclose(runs[j].out);
+		}
+		double ratio = (runs[0].wall > 0) ? runs[1].wall / runs[0].wall : NAN;
+		if (ratio > 0 && isfinite(ratio)) { log_ratio_sum += log(ratio); ++nratios; }
+		printf("%-32s %8.3fs %8.3fs %8.3fs %8.3fs %6.2fx  %s%s%s\n", name,
+			runs[0].wall, runs[1].wall, runs[0].cpu, runs[1].cpu, ratio,
+			same ? "same" : "DIFFERS",
+			runs[0].ok ? "" : " (a failed)", runs[1].ok ? "" : " (b failed)");
+		fflush(stdout);
+	}
+
+	printf("\n%u submission(s) replayed, of %zu for project %u\n", nsamples, nnames, num);
+	for (unsigned j = 0; j < 2; ++j)
+	{
+		printf("%c: %s: total wall %.3fs, total cpu %.3fs, %u failure(s)\n",
+			"ab"[j], scripts[j], total_wall[j], total_cpu[j], nfailed[j]);
+	}
+	if (nratios > 0)
+	{
+		double geomean = exp(log_ratio_sum / nratios);
+		printf("b/a wall time: %.2fx overall, %.2fx geometric mean per submission (%s)\n",
+			(total_wall[0] > 0) ? total_wall[1] / total_wall[0] : NAN, geomean,
+			(geomean > 1) ? "b is slower" : "b is faster");
+	}
+	if (ndiffering) printf("%u output(s) differ; see %s\n", ndiffering, diffdir);
+
+	for (size_t i = 0; i < nnames; ++i) free(names[i]);
+	free(names);
+	free(diffdir);
+	fclose(devnull);
+	pack_close(p);
+	closedir(subsdir);
+	return 0;
+}
@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <time.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <err.h>
+
+#include "project.h"
+
+/* A ready-made check_sanity for module libraries. Rather than writing
+ * code, a project supplies a struct sanity_policy as its check_sanity_arg
+ * (see project.h). We check the whole archive in one pass over an mmap()
+ * of it, so junk is rejected before any helper process gets spawned.
+ * Note that we must not move the file offset of tarfd: it is shared with
+ * the stdin of any helper we later run. */
+
+#define TAR_BLOCK 512
+/* Don't drown the student in complaints. */
+#define MAX_COMPLAINTS 10
+
+struct ustar_header
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+static void audit_note(FILE *auditf, const char *fmt, ...)
+{
+	if (!auditf) return;
+	char datebuf[64];
+	time_t t = time(NULL);
+	struct tm tm;
+	strftime(datebuf, sizeof datebuf, "%F %T", gmtime_r(&t, &tm));
+	fprintf(auditf, "%s ", datebuf);
+	va_list ap;
+	va_start(ap, fmt);
+	vfprintf(auditf, fmt, ap);
+	va_end(ap);
+	fputc('\n', auditf);
+	fflush(auditf);
+}
+
+static _Bool parse_octal(const char *field, size_t len, unsigned long long *out)
+{
+	unsigned long long n = 0;
+	size_t i = 0;
+	while (i < len && field[i] == ' ') ++i;
+	if (i == len || field[i] < '0' || field[i] > '7') return 0;
+	for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i) n = (n << 3) | (field[i] - '0');
+	if (i < len && field[i] != ' ' && field[i] != '\0') return 0;
+	*out = n;
+	return 1;
+}
+
+static _Bool checksum_ok(const unsigned char *block)
+{
+	const struct ustar_header *h = (const struct ustar_header *) block;
+	unsigned long long stored;
+	if (!parse_octal(h->chksum, sizeof h->chksum, &stored)) return 0;
+	unsigned long sum = 0;
+	for (unsigned i = 0; i < TAR_BLOCK; ++i)
+	{
+		_Bool in_chksum = (i >= offsetof(struct ustar_header, chksum)
+			&& i < offsetof(struct ustar_header, chksum) + sizeof h->chksum);
+		sum += in_chksum ? ' ' : block[i];
+	}
+	return sum == stored;
+}
+
+static _Bool is_zero_block(const unsigned char *block)
+{
+	return block[0] == '\0' && 0 == memcmp(block, block + 1, TAR_BLOCK - 1);
+}
+
+/* Does this look like a tar header (rather than, say, a git diff)? */
+static _Bool is_tar_header(const unsigned char *block)
+{
+	const struct ustar_header *h = (const struct ustar_header *) block;
+	unsigned long long size;
+	return checksum_ok(block) && parse_octal(h->size, sizeof h->size, &size);
+}
+
+static _Bool has_extension(const char *name, const char *ext)
+{
+	size_t namelen = strlen(name), extlen = strlen(ext);
+	return namelen > extlen && 0 == strcasecmp(name + namelen - extlen, ext);
+}
+
+_Bool check_sanity_policy(DIR *dir, FILE *auditf, FILE *outf, int tarfd, void *arg)
+{
+	const struct sanity_policy *policy = arg;
+	if (!policy) return 1;
+	struct stat s;
+	if (fstat(tarfd, &s) != 0) { warn("stat'ing submission"); return 0; }
+	if (s.st_size == 0) { fprintf(outf, "Your submission is empty.\n"); return 0; }
+	const unsigned char *base = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, tarfd, 0);
+	if (base == MAP_FAILED) { warn("mapping submission"); return 0; }
+	/* Sequential is what we do, so say so. */
+	madvise((void *) base, s.st_size, MADV_SEQUENTIAL);
+	if (s.st_size < TAR_BLOCK || (!is_zero_block(base) && !is_tar_header(base)))
+	{
+		/* Not a tar file at all (e.g. a git-format submission, which may
+		 * well be smaller than one tar block); the policy is not for us
+		 * to apply. */
+		audit_note(auditf, "Sanity policy not applied: submission is not a tar file");
+		munmap((void *) base, s.st_size);
+		return 1;
+	}
+
+	unsigned nrequired = 0;
+	if (policy->required_paths) while (policy->required_paths[nrequired]) ++nrequired;
+	_Bool found[nrequired ? nrequired : 1];
+	memset(found, 0, sizeof found);
+
+	unsigned ncomplaints = 0;
+#define complain(fmt, args...) do { \
+	if (ncomplaints++ < MAX_COMPLAINTS) fprintf(outf, fmt "\n", ##args); \
+	audit_note(auditf, "Sanity policy: " fmt, ##args); } while (0)
+
+	char namebuf[PATH_MAX + 1];
+	char *longname = NULL;
+	off_t off = 0;
+	while (off + TAR_BLOCK <= s.st_size)
+	{
+		const unsigned char *block = base + off;
+		if (is_zero_block(block)) break; // end-of-archive marker
+		const struct ustar_header *h = (const struct ustar_header *) block;
+		unsigned long long size;
+		if (!checksum_ok(block) || !parse_octal(h->size, sizeof h->size, &size))
+		{
+			complain("Your submission is a corrupt tar file (bad header at offset %ld)", (long) off);
+			break;
+		}
+		off_t data_off = off + TAR_BLOCK;
+		if (size > (unsigned long long) (s.st_size - data_off))
+		{
+			complain("Your submission is a truncated tar file");
+			break;
+		}
+		off = data_off + ((size + TAR_BLOCK - 1) / TAR_BLOCK) * TAR_BLOCK;
+
+		if (h->typeflag == 'L')
+		{
+			/* GNU long name: the next entry's name is our contents. */
+			free(longname);
+			longname = strndup((const char *) base + data_off, size);
+			continue;
+		}
+		const char *name;
+		if (longname) name = longname;
+		else
+		{
+			if (0 == memcmp(h->magic, "ustar", 5) && h->prefix[0] != '\0')
+			{
+				snprintf(namebuf, sizeof namebuf, "%.*s/%.*s",
+					(int) sizeof h->prefix, h->prefix, (int) sizeof h->name, h->name);
+			}
+			else snprintf(namebuf, sizeof namebuf, "%.*s", (int) sizeof h->name, h->name);
+			name = namebuf;
+		}
+		while (name[0] == '.' && name[1] == '/') name += 2;
+
+		for (unsigned i = 0; i < nrequired; ++i)
+		{
+			if (0 == strcmp(name, policy->required_paths[i])) found[i] = 1;
+		}
+		if (h->typeflag == '0' || h->typeflag == '\0')
+		{
+			for (const char **ext = policy->forbidden_extensions; ext && *ext; ++ext)
+			{
+				if (has_extension(name, *ext))
+				{
+					complain("File %s is not allowed (no '%s' files, please)", name, *ext);
+					break;
+				}
+			}
+			if (policy->max_file_size && size > policy->max_file_size)
+			{
+				complain("File %s is too big (%llu bytes; the limit is %lu)",
+					name, size, (unsigned long) policy->max_file_size);
+			}
+			/* memchr() is vectorised in any libc worth having, so this
+			 * is the fast way to spot binaries. */
+			else if (policy->reject_binary && memchr(base + data_off, '\0', size))
+			{
+				complain("File %s looks like a binary (it contains NUL bytes)", name);
+			}
+		}
+		free(longname);
+		longname = NULL;
+	}
+	free(longname);
+	for (unsigned i = 0; i < nrequired; ++i)
+	{
+		if (!found[i]) complain("Required file %s is missing", policy->required_paths[i]);
+	}
+	if (ncomplaints > MAX_COMPLAINTS)
+	{
+		fprintf(outf, "(... and %u more problem(s))\n", ncomplaints - MAX_COMPLAINTS);
+	}
+#undef complain
+	munmap((void *) base, s.st_size);
+	errno = 0; // our reasons are above; don't let the caller blame a syscall
+	return ncomplaints == 0;
+}
@@ -0,0 +1,117 @@
+#include <sys/types.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "submit.h"
+
+/* A plain SHA-256 (FIPS 180-4), so that we can give archives a stable
+ * digest without dragging another library into our static link. */
+
+static const uint32_t k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ror(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(struct sha256_ctx *ctx, const unsigned char *p)
+{
+	uint32_t w[64];
+	for (unsigned i = 0; i < 16; ++i)
+	{
+		w[i] = (uint32_t) p[4*i] << 24 | (uint32_t) p[4*i + 1] << 16
+			| (uint32_t) p[4*i + 2] << 8 | (uint32_t) p[4*i + 3];
+	}
+	for (unsigned i = 16; i < 64; ++i)
+	{
+		uint32_t s0 = ror(w[i-15], 7) ^ ror(w[i-15], 18) ^ (w[i-15] >> 3);
+		uint32_t s1 = ror(w[i-2], 17) ^ ror(w[i-2], 19) ^ (w[i-2] >> 10);
+		w[i] = w[i-16] + s0 + w[i-7] + s1;
+	}
+	uint32_t a = ctx->h[0], b = ctx->h[1], c = ctx->h[2], d = ctx->h[3],
+		e = ctx->h[4], f = ctx->h[5], g = ctx->h[6], h = ctx->h[7];
+	for (unsigned i = 0; i < 64; ++i)
+	{
+		uint32_t t1 = h + (ror(e, 6) ^ ror(e, 11) ^ ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+		uint32_t t2 = (ror(a, 2) ^ ror(a, 13) ^ ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		h = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	ctx->h[0] += a; ctx->h[1] += b; ctx->h[2] += c; ctx->h[3] += d;
+	ctx->h[4] += e; ctx->h[5] += f; ctx->h[6] += g; ctx->h[7] += h;
+}
+
+void sha256_init(struct sha256_ctx *ctx)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+	memcpy(ctx->h, h0, sizeof h0);
+	ctx->len = 0;
+	ctx->buflen = 0;
+}
+
+void sha256_update(struct sha256_ctx *ctx, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	ctx->len += len;
+	if (ctx->buflen > 0)
+	{
+		size_t n = sizeof ctx->buf - ctx->buflen;
+		if (n > len) n = len;
+		memcpy(ctx->buf + ctx->buflen, p, n);
+		ctx->buflen += n; p += n; len -= n;
+		if (ctx->buflen < sizeof ctx->buf) return;
+		sha256_block(ctx, ctx->buf);
+		ctx->buflen = 0;
+	}
+	for (; len >= sizeof ctx->buf; p += sizeof ctx->buf, len -= sizeof ctx->buf)
+	{
+		sha256_block(ctx, p);
+	}
+	memcpy(ctx->buf, p, len);
+	ctx->buflen = len;
+}
+
+void sha256_final_hex(struct sha256_ctx *ctx, char hex[SHA256_HEX_LEN + 1])
+{
+	uint64_t bits = ctx->len * 8;
+	unsigned char pad[72] = { 0x80 };
+	size_t padlen = (ctx->buflen < 56) ? (56 - ctx->buflen) : (120 - ctx->buflen);
+	for (unsigned i = 0; i < 8; ++i) pad[padlen + i] = bits >> (56 - 8*i);
+	sha256_update(ctx, pad, padlen + 8);
+	for (unsigned i = 0; i < 8; ++i) sprintf(hex + 8*i, "%08x", ctx->h[i]);
+}
+
+/* Digest a whole file. We use pread() so as not to disturb the offset,
+ * which is shared with anything we later hand the fd to. */
+int sha256_fd_hex(int fd, char hex[SHA256_HEX_LEN + 1])
+{
+	struct sha256_ctx ctx;
+	sha256_init(&ctx);
+	char buf[65536];
+	off_t off = 0;
+	ssize_t nread;
+	while (0 != (nread = pread(fd, buf, sizeof buf, off)))
+	{
+		if (nread == -1)
+		{
+			if (errno == EINTR) continue;
+			return -1;
+		}
+		sha256_update(&ctx, buf, nread);
+		off += nread;
+	}
+	sha256_final_hex(&ctx, hex);
+	return 0;
+}
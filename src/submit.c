@@ -14,6 +14,7 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <string.h>
+#include <limits.h>
 #include <err.h>
 #include <pwd.h>
 
@@ -24,15 +25,20 @@
 #elif defined(SUBMISSION_FORMAT_GIT_DIFF)
 #define SUBMISSION_FORMAT_EXT "patch"
 #define SUBMISSION_FILE_HANDLE_TYPE FILE
+#elif defined(SUBMISSION_FORMAT_GIT_BUNDLE)
+#define SUBMISSION_FORMAT_EXT "bundle"
+#define SUBMISSION_FILE_HANDLE_TYPE FILE
 #else
 #error "No submission format defined"
 #endif
 #include "project.h"
+#include "submit.h"
 
 #define stringify_(t) #t
 #define stringify(t) stringify_(t)
 
 const char submissions_path_prefix[] = stringify(SUBMISSIONS_PATH_PREFIX);
+const char submission_format_ext[] = SUBMISSION_FORMAT_EXT;
 
 char *submitting_user; // in environ
 uid_t ruid;
@@ -71,6 +77,43 @@ USAGE_MSG
 
 size_t name_max = 255; /* max filename length... we get it from pathconf() */
 #ifdef SUBMISSION_FORMAT_TAR
+#ifdef CANONICAL_ARCHIVE
+/* In canonical mode, the same tree must always give the same bytes, so that
+ * archives can be compared (and cached, dedup'd etc.) by digest. So we
+ * visit directory entries in bytewise name order (not locale order)... */
+static int compar_dirent_name(const struct dirent **e1, const struct dirent **e2)
+{
+	return strcmp((*e1)->d_name, (*e2)->d_name);
+}
+
+/* ... and we write our own headers with normalised metadata: no real
+ * mtimes or owners, modes reduced to 0644/0755, and no hardlink sharing
+ * (which libtar's tar_append_file() would do based on inode numbers).
+ * Since we never open the TAR with TAR_GNU, headers are plain ustar. */
+static int tar_append_canonical(TAR *t, char *name, const struct stat *real)
+{
+	struct stat s = {
+		.st_mode = S_ISLNK(real->st_mode) ? (S_IFLNK | 0777)
+			: (real->st_mode & 0111) ? (S_IFREG | 0755) : (S_IFREG | 0644),
+		.st_size = S_ISREG(real->st_mode) ? real->st_size : 0
+		/* uid, gid and mtime are all zero */
+	};
+	memset(&t->th_buf, 0, sizeof t->th_buf);
+	th_set_from_stat(t, &s);
+	th_set_path(t, name);
+	if (S_ISLNK(real->st_mode))
+	{
+		char linkbuf[PATH_MAX + 1];
+		ssize_t len = readlink(name, linkbuf, sizeof linkbuf - 1);
+		if (len == -1) return -1;
+		linkbuf[len] = '\0';
+		th_set_link(t, linkbuf);
+	}
+	if (t->options & TAR_VERBOSE) th_print_long_ls(t);
+	if (th_write(t) != 0) return -1;
+	return S_ISREG(real->st_mode) ? tar_append_regfile(t, name) : 0;
+}
+#endif
 _Bool recursively_add_directory(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_FILE_HANDLE_TYPE *t,
 	char *prefix, unsigned *size, size_t max_size)
 {
@@ -84,7 +127,13 @@ _Bool recursively_add_directory(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_F
 #endif
 	struct dirent *the_entry = NULL;
 	int ret;
-#ifdef USE_READDIR_R
+#if defined(CANONICAL_ARCHIVE)
+	struct dirent **sorted;
+	int nsorted = scandirat(dirfd(dir), ".", &sorted, NULL, compar_dirent_name);
+	if (nsorted == -1) err(EXIT_FAILURE, "listing directory %s", prefix);
+	int pos = 0;
+	while (pos < nsorted && NULL != (the_entry = sorted[pos++]))
+#elif defined(USE_READDIR_R)
 	while (0 == (ret = readdir_r(dir, entryp, &the_entry)) && the_entry)
 #else
 	while (NULL != (the_entry = readdir(dir)))
@@ -117,8 +166,14 @@ _Bool recursively_add_directory(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_F
 					success = 0;
 					break;
 				}
+#ifdef CANONICAL_ARCHIVE
+				ret = tar_append_canonical(t, namebuf, &s);
+				if (ret != 0) err(EXIT_FAILURE, "adding %s to tar file", namebuf);
+#else
 				tar_append_file(t, namebuf, namebuf);
+#endif
 				*size += s.st_size;
+				board_bytes(*size);
 			}
 			else if (the_entry->d_type == DT_DIR)
 			{
@@ -145,6 +200,10 @@ _Bool recursively_add_directory(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_F
 
 		the_entry = NULL; // just to be safe
 	}
+#ifdef CANONICAL_ARCHIVE
+	for (int i = 0; i < nsorted; ++i) free(sorted[i]);
+	free(sorted);
+#endif
 #ifdef USE_READDIR_R
 	free(entryp);
 #endif
@@ -198,6 +257,7 @@ _Bool write_submission_git_diff(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_F
 			goto out;
 		}
 		nbytes += nread;
+		board_bytes(nbytes);
 	}
 	int status;
 out:
@@ -221,6 +281,79 @@ git_error:
 
 #endif
 
+#if defined(SUBMISSION_FORMAT_GIT_BUNDLE)
+// we return 1 for success
+_Bool write_submission_git_bundle(DIR *dir, FILE *auditf, FILE *outf, SUBMISSION_FILE_HANDLE_TYPE *t, size_t max, void *arg)
+{
+	/* Like the git diff format, arg is the project's base commit. But we
+	 * submit the student's commits since then, as a bundle having that
+	 * commit as its prerequisite. Git packs bundles thin, so the base's
+	 * objects are not included: a helper can verify and check out the
+	 * bundle against a single lecturer-held repository containing the
+	 * base (see checkout_bundle_submission in scripts/funcs.sh).
+	 * Unlike the diff, we never truncate: too big means rejected. */
+	char *cmd;
+	int ret = asprintf(&cmd, "git rev-parse -q --verify '%s^{commit}' >/dev/null"
+		" || { echo 'Your repository does not contain the project base commit %s' 1>&2; exit 1; }"
+		" && git bundle create - '%s..HEAD'",
+		(char*) arg, (char*) arg, (char*) arg);
+	if (ret == -1) { warnx("Problem printing git command string"); return 0; }
+	/* A bundle holds only commits, so unlike a diff it silently leaves
+	 * out uncommitted work. Say so before the student is surprised. */
+	FILE *status_out = popen("git status --porcelain 2>/dev/null", "r");
+	if (status_out)
+	{
+		unsigned nchanged = 0;
+		char line[1024];
+		while (fgets(line, sizeof line, status_out)) if (strchr(line, '\n')) ++nchanged;
+		pclose(status_out);
+		if (nchanged > 0)
+		{
+			warnx("Warning: %u file(s) have uncommitted changes or are untracked (see 'git status');"
+				" only committed work is included", nchanged);
+			audit_println("Working tree has %u uncommitted or untracked file(s)", nchanged);
+		}
+	}
+	FILE *bundle = popen(cmd, "r");
+	free(cmd);
+	if (!bundle) { warn("running git"); return 0; }
+	size_t nbytes = 0;
+	_Bool too_big = 0;
+	char buf[8192];
+	size_t nread;
+	while (0 != (nread = fread(buf, 1, sizeof buf, bundle)))
+	{
+		if (nbytes + nread > max) { too_big = 1; break; }
+		if (fwrite(buf, 1, nread, t) != nread)
+		{
+			warnx("Problem writing git bundle");
+			pclose(bundle);
+			return 0;
+		}
+		nbytes += nread;
+		board_bytes(nbytes);
+	}
+	/* If we stopped early, git may get SIGPIPE; that's expected. */
+	int status = pclose(bundle);
+	if (too_big)
+	{
+		warnx("Submission exceeded maximum size (%lu bytes)", (unsigned long) max);
+		audit_println("Submission exceeded maximum size (%lu bytes)", (unsigned long) max);
+		errno = EFBIG;
+		return 0;
+	}
+	if (status != 0)
+	{
+		warnx("git returned an error; did you specify the path of the right git repo,"
+			" and have you committed your changes?");
+		errno = EINVAL;
+		return 0;
+	}
+	audit_println("Bundle of %lu bytes on base %s", (unsigned long) nbytes, (char*) arg);
+	return 1;
+}
+#endif
+
 _Bool run_helper(const char *helper_filename, const char *helper_argv1,
 	DIR *dir, FILE *auditf, FILE *outf, int submfd /* may be -1 */)
 {
@@ -419,21 +552,107 @@ out:
 	free(timestamp_path);
 }
 
+#ifdef CANONICAL_ARCHIVE
+/* Give a canonical submission its digest as its identifier, in place of
+ * the random mkstemps() characters. Resubmitting an identical archive
+ * still makes a new file (so the newest file is always the latest
+ * submission), named with a sequence number after the digest: <digest>.2,
+ * <digest>.3 and so on. Returns the new path, freeing the old one. */
+static char *rename_to_digest(char *subpath, unsigned num, const char *digest)
+{
+	/* We need the lecturer's euid back to modify the submissions directory
+	 * (and to read any pack, whose names are taken too). */
+	int ret = seteuid(LECTURER_UID);
+	if (ret != 0) err(EXIT_FAILURE, "seteuid(%ld)", (long) LECTURER_UID);
+	struct pack *p = pack_open(num);
+	char *digest_path = NULL;
+	unsigned seq;
+	for (seq = 1; ; ++seq)
+	{
+		char seqbuf[16] = "";
+		if (seq > 1) snprintf(seqbuf, sizeof seqbuf, ".%u", seq);
+		free(digest_path);
+		ret = asprintf(&digest_path, "%s/%02d-%s-%s%s." SUBMISSION_FORMAT_EXT,
+			submissions_path_prefix, num, submitting_user, digest, seqbuf);
+		if (ret < 0) errx(EXIT_FAILURE, "printing submission path");
+		if (p && pack_lookup(p, basename(digest_path))) continue;
+		ret = link(subpath, digest_path);
+		if (ret == 0) break;
+		if (errno != EEXIST) err(EXIT_FAILURE, "linking submission to %s", digest_path);
+	}
+	pack_close(p);
+	if (seq > 1)
+	{
+		warnx("This submission is identical to one you made earlier (but is now your latest)");
+		audit_println("Submission is a resubmission of %02d-%s-%s." SUBMISSION_FORMAT_EXT,
+			num, submitting_user, digest);
+	}
+	ret = unlink(subpath);
+	if (ret != 0) err(EXIT_FAILURE, "unlinking temporary submission %s", subpath);
+	ret = seteuid(ruid);
+	if (ret != 0) err(EXIT_FAILURE, "seteuid(%ld)", (long) ruid);
+	free(subpath);
+	return digest_path;
+}
+#endif
+
+/* The lecturer's tools run with the lecturer's privileges, so they
+ * must not be usable by anyone else. */
+static void require_lecturer(const char *argv0)
+{
+	if (getuid() != LECTURER_UID) errx(EXIT_FAILURE, "%s is for the lecturer only", argv0);
+}
+
 int main(int argc, char **argv)
 {
 	if (argc <= 0) abort(); // be super-defensive about corrupt args
-	enum { INVALID, SUBMIT, LSSUB, FEEDBACK } mode;
+	enum { INVALID, SUBMIT, LSSUB, FEEDBACK, TOP, COLLECT, REPLAY, PACK, CATSUB, AUDIT } mode = INVALID;
 	if (0 == strcmp(basename(argv[0]), "submit")) mode = SUBMIT;
 	else if (0 == strcmp(basename(argv[0]), "feedback")) mode = FEEDBACK;
 	else if (0 == strcmp(basename(argv[0]), "lssub")) mode = LSSUB;
+	else if (0 == strcmp(basename(argv[0]), "afb-top")) mode = TOP;
+	else if (0 == strcmp(basename(argv[0]), "collect")) mode = COLLECT;
+	else if (0 == strcmp(basename(argv[0]), "replay")) mode = REPLAY;
+	else if (0 == strcmp(basename(argv[0]), "packsub")) mode = PACK;
+	else if (0 == strcmp(basename(argv[0]), "catsub")) mode = CATSUB;
+	else if (0 == strcmp(basename(argv[0]), "afb-audit")) mode = AUDIT;
 	if (mode == INVALID)
 	{
-		errx(EXIT_FAILURE, "You must invoke this program as 'submit' or 'feedback' or 'lssub'");
+		errx(EXIT_FAILURE, "You must invoke this program as 'submit', 'feedback', 'lssub' or 'catsub'"
+			" (or, for the lecturer, 'afb-top', 'afb-audit', 'collect', 'replay' or 'packsub')");
+	}
+	/* The lecturer-only tools don't take a project number. */
+	if (mode == TOP)
+	{
+		require_lecturer(argv[0]);
+		return board_top(argc, argv);
+	}
+	if (mode == AUDIT)
+	{
+		require_lecturer(argv[0]);
+		return audit_main(argc, argv);
 	}
 	if (argc < 2) errx(EXIT_FAILURE, usage, argv[0]);
 	if (argv[1][0] < '0' || argv[1][0] > '9') errx(EXIT_FAILURE, usage, argv[0]);
 	unsigned num = atoi(argv[1]);
 	if (num < 1 || num > 12) errx(EXIT_FAILURE, "invalid project number: %d", num);
+	if (mode == COLLECT)
+	{
+		require_lecturer(argv[0]);
+		return collect_main(num, argc, argv);
+	}
+	if (mode == REPLAY)
+	{
+		require_lecturer(argv[0]);
+		/* It runs the project's scripts, so the project must exist. */
+		if (num > NPROJECTS) errx(EXIT_FAILURE, "bad project number %u", num);
+		return replay_main(num, argc, argv);
+	}
+	if (mode == PACK)
+	{
+		require_lecturer(argv[0]);
+		return pack_main(num, argc, argv);
+	}
 
 	/* If we're doing a submission, we need a writable fd onto a tar
  	 * descriptor, and a writable fd only the activity log file. If
@@ -458,6 +677,12 @@ int main(int argc, char **argv)
 	{
 		err(EXIT_FAILURE, "error: USER must be set");
 	}
+	/* catsub only reads, so it needn't bother with the board or audit log. */
+	if (mode == CATSUB) return catsub_main(num, argc, argv);
+	/* Put ourselves on the request board while we still have the lecturer's
+	 * euid (it's the lecturer's shared memory). lssub is over in a moment
+	 * and has no outcome to count, so it stays off. */
+	if (mode != LSSUB) board_enter(submitting_user, num, basename(argv[0]));
 
 	/* We want to open the submission and/or audit files
 	 * as appropriate, then drop our privileges. We also
@@ -472,8 +697,10 @@ int main(int argc, char **argv)
 	auditf = fopen(audit_path, "a");
 	if (!auditf) err(EXIT_FAILURE, "opening audit file `%s'", audit_path);
 	free(audit_path);
+	board_phase(PHASE_LOCKING);
 	ret = flock(fileno(auditf), LOCK_EX | LOCK_NB);
 	if (ret != 0) err(EXIT_FAILURE, "locking audit file (try again in a minute?)");
+	board_audit_lock(1);
 	/* Problem: when do we unlock the audit file?
 	 * Currently, only when we reach the end of main().
 	 * For 'submit' this is fine.
@@ -506,9 +733,38 @@ int main(int argc, char **argv)
 			ret = asprintf(&namepat, "%02d-%s-??????." SUBMISSION_FORMAT_EXT,
 				num, submitting_user);
 			if (ret < 0) errx(EXIT_FAILURE, "printing submission filename pattern");
+			/* Packed submissions first, since find can't see those. */
+			struct pack *p = pack_open(num);
+			for (size_t i = 0; p && i < p->nentries; ++i)
+			{
+				if (!pack_entry_is_callers(&p->entries[i], num)) continue;
+				printf("./%s (packed; see it with: %s/catsub %d %s)\n", p->entries[i].name,
+					dirname(strdup(argv[0])), num, p->entries[i].name);
+			}
+			pack_close(p);
+			fflush(stdout);
+#ifdef CANONICAL_ARCHIVE
+			/* Canonical submissions are named by their digest, plus a
+			 * sequence number for resubmissions (see rename_to_digest);
+			 * but still list any made earlier with random identifiers. */
+			char *digestpat, *resubpat;
+			ret = asprintf(&digestpat, "%02d-%s-%.*s." SUBMISSION_FORMAT_EXT,
+				num, submitting_user, SHA256_HEX_LEN,
+				"????????????????????????????????????????????????????????????????");
+			if (ret < 0) errx(EXIT_FAILURE, "printing submission filename pattern");
+			ret = asprintf(&resubpat, "%02d-%s-%.*s.*." SUBMISSION_FORMAT_EXT,
+				num, submitting_user, SHA256_HEX_LEN,
+				"????????????????????????????????????????????????????????????????");
+			if (ret < 0) errx(EXIT_FAILURE, "printing submission filename pattern");
+			execl("/usr/bin/find", "/usr/bin/find", submissions_path_prefix,
+ 				"-type", "f", "(", "-name", namepat, "-o", "-name", digestpat,
+				"-o", "-name", resubpat, ")",
+				"-execdir", "/bin/ls", "-1d", "{}", ";", NULL);
+#else
 			execl("/usr/bin/find", "/usr/bin/find", submissions_path_prefix,
  				"-type", "f", "-name", namepat, "-execdir", "/bin/ls",
 				"-1d", "{}", ";", NULL);
+#endif
 			//' | sort -k6 -k7 | column -t
 			err(EXIT_FAILURE, "internal error: could not execl");
 			assert(0);
@@ -567,6 +823,7 @@ int main(int argc, char **argv)
 	 * and write it to the submission file. */
 	DIR *the_d = opendir(d);
 	if (!the_d) err(EXIT_FAILURE, "opening submission directory %s (really: %s)", d, real_d);
+	board_phase(PHASE_ARCHIVING);
 
 	/* Also chdir to it. */
 	ret = chdir(d);
@@ -581,6 +838,22 @@ int main(int argc, char **argv)
 	_Bool success = write_submission_git_diff(the_d, auditf, stderr, submission_hdl,
 		(mode == SUBMIT) ? MAX_SUBMISSION_SIZE : MAX_FEEDBACK_SIZE, projects[num]->check_sanity_arg);
 	if (!success) err(EXIT_FAILURE, "error writing git diff for submission at %s (really: %s)", d, real_d);
+#elif defined(SUBMISSION_FORMAT_GIT_BUNDLE)
+	_Bool success = write_submission_git_bundle(the_d, auditf, stderr, submission_hdl,
+		(mode == SUBMIT) ? MAX_SUBMISSION_SIZE : MAX_FEEDBACK_SIZE, projects[num]->check_sanity_arg);
+	if (!success)
+	{
+		/* Don't leave a partial bundle where it looks like a submission.
+		 * We need the lecturer's euid back to modify the directory. */
+		int saved_errno = errno;
+		if (mode == SUBMIT && 0 == seteuid(LECTURER_UID))
+		{
+			unlink(subpath);
+			if (0 != seteuid(ruid)) err(EXIT_FAILURE, "seteuid(%ld)", (long) ruid);
+		}
+		errno = saved_errno;
+		err(EXIT_FAILURE, "error writing git bundle for submission at %s (really: %s)", d, real_d);
+	}
 #else
 #error "Unknown submission format"
 #endif
@@ -596,8 +869,15 @@ int main(int argc, char **argv)
 	/* Now re-open the submission from the same fd. */
 	off_t o = lseek(subm_rd_fd, 0, SEEK_SET);
 	if (o != 0) err(EXIT_FAILURE, "seeking back to start of submission file");
+#ifdef CANONICAL_ARCHIVE
+	char digest[SHA256_HEX_LEN + 1];
+	ret = sha256_fd_hex(subm_rd_fd, digest);
+	if (ret != 0) err(EXIT_FAILURE, "computing digest of submission file");
+	audit_println("Submission digest is sha256:%s", digest);
+#endif
 
 	/* Sanity-check the submission from the file. */
+	board_phase(PHASE_SANITY);
 	errno = 0;
 	success = projects[num]->check_sanity(the_d, auditf, stdout, subm_rd_fd,
 		projects[num]->check_sanity_arg);
@@ -615,6 +895,12 @@ int main(int argc, char **argv)
 	switch (mode)
 	{
 		case SUBMIT:
+#ifdef CANONICAL_ARCHIVE
+			/* Only now that it's known to be sane, so that insane
+			 * submissions never take a name. */
+			subpath = rename_to_digest(subpath, num, digest);
+#endif
+			board_phase(PHASE_FINALISING);
 			success = projects[num]->finalise_submission(
 				the_d, auditf, stdout, subm_rd_fd,
 				projects[num]->finalise_submission_arg);
@@ -640,6 +926,8 @@ int main(int argc, char **argv)
 			flock(fileno(auditf), LOCK_UN);
 			fclose(auditf);
 			auditf = NULL;
+			board_audit_lock(0);
+			board_phase(PHASE_FEEDBACK);
 			success = projects[num]->write_feedback(
 				the_d, auditf, stdout, subm_rd_fd,
 			        projects[num]->write_feedback_arg);